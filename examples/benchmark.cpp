@@ -0,0 +1,1127 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include <lua.hpp>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "luacpp11.hpp"
+
+// runs a script and prints how long it took
+void run(lua_State *L, const char *name, const char *script)
+{
+    auto start = std::chrono::steady_clock::now();
+    int result = luaL_dostring(L, script);
+    auto end = std::chrono::steady_clock::now();
+    if (result) {
+        std::cerr << "Error: " << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1);
+        return;
+    }
+    std::chrono::duration<double, std::milli> ms = end - start;
+    std::cout << name << ": " << ms.count() << " ms" << std::endl;
+}
+
+namespace luacpp11 {
+    // adds a function to the metatable on top of the stack
+    template<class F>
+    void add_function(lua_State *L, const char *name, F f)
+    {
+        lua_pushstring(L, name);
+        push_callable(L, f);
+        lua_rawset(L, -3);
+    }
+}
+
+double add(double a, double b)
+{
+    return a + b;
+}
+
+// closure trampolines vs ffi function pointers. Outside of LuaJIT both
+// globals hold the same kind of closure.
+void bench_ffi(lua_State *L)
+{
+    luacpp11::push_callable(L, add);
+    lua_setglobal(L, "add");
+
+    luacpp11::push_ffi_callable(L, add);
+    lua_setglobal(L, "ffi_add");
+
+    run(L, "closure call",
+        "local add, x = add, 0\n"
+        "for i = 1, 10000000 do x = add(x, i) end\n"
+    );
+    run(L, "ffi call",
+        "local add, x = ffi_add, 0\n"
+        "for i = 1, 10000000 do x = add(x, i) end\n"
+    );
+}
+
+size_t vec_size(const std::vector<int> &v)
+{
+    return v.size();
+}
+
+// argument validation cost of the different call policies on tiny functions
+void bench_policies(lua_State *L)
+{
+    luacpp11::push_callable<luacpp11::checked>(L, add);
+    lua_setglobal(L, "add_checked");
+    luacpp11::push_callable<luacpp11::debug_checked>(L, add);
+    lua_setglobal(L, "add_debug_checked");
+    luacpp11::push_callable<luacpp11::unchecked>(L, add);
+    lua_setglobal(L, "add_unchecked");
+
+    luacpp11::push_callable<luacpp11::checked>(L, vec_size);
+    lua_setglobal(L, "size_checked");
+    luacpp11::push_callable<luacpp11::debug_checked>(L, vec_size);
+    lua_setglobal(L, "size_debug_checked");
+    luacpp11::push_callable<luacpp11::unchecked>(L, vec_size);
+    lua_setglobal(L, "size_unchecked");
+
+    // unchecked calls require the exact argument type
+    luacpp11::emplace< const std::vector<int> >(L, 10);
+    lua_setglobal(L, "vec");
+
+    run(L, "checked number args",
+        "local f, x = add_checked, 0\n"
+        "for i = 1, 10000000 do x = f(x, i) end\n"
+    );
+    run(L, "debug_checked number args",
+        "local f, x = add_debug_checked, 0\n"
+        "for i = 1, 10000000 do x = f(x, i) end\n"
+    );
+    run(L, "unchecked number args",
+        "local f, x = add_unchecked, 0\n"
+        "for i = 1, 10000000 do x = f(x, i) end\n"
+    );
+    run(L, "checked userdata arg",
+        "local f, v = size_checked, vec\n"
+        "for i = 1, 10000000 do f(v) end\n"
+    );
+    run(L, "debug_checked userdata arg",
+        "local f, v = size_debug_checked, vec\n"
+        "for i = 1, 10000000 do f(v) end\n"
+    );
+    run(L, "unchecked userdata arg",
+        "local f, v = size_unchecked, vec\n"
+        "for i = 1, 10000000 do f(v) end\n"
+    );
+}
+
+template<int N>
+struct Widget {
+    int get_a() const { return a; }
+    int get_b() const { return b; }
+    int get_c() const { return c; }
+    int get_d() const { return d; }
+    void set_a(int v) { a = v; }
+    void set_b(int v) { b = v; }
+    void set_c(int v) { c = v; }
+    void set_d(int v) { d = v; }
+    int a, b, c, d;
+};
+
+// registers the methods into the metatable on top of the stack
+template<class T, bool Const>
+void add_widget_methods(lua_State *L)
+{
+    luacpp11::add_function(L, "get_a", &T::get_a);
+    luacpp11::add_function(L, "get_b", &T::get_b);
+    luacpp11::add_function(L, "get_c", &T::get_c);
+    luacpp11::add_function(L, "get_d", &T::get_d);
+    if(Const)
+        return;
+    luacpp11::add_function(L, "set_a", &T::set_a);
+    luacpp11::add_function(L, "set_b", &T::set_b);
+    luacpp11::add_function(L, "set_c", &T::set_c);
+    luacpp11::add_function(L, "set_d", &T::set_d);
+}
+
+namespace luacpp11 {
+    // Widget<0> registers every variant separately
+    template<>
+    struct register_hook< Widget<0> > {
+        static void on_register(lua_State *L) { add_widget_methods<Widget<0>, false>(L); }
+    };
+    template<>
+    struct register_hook< const Widget<0> > {
+        static void on_register(lua_State *L) { add_widget_methods<Widget<0>, true>(L); }
+    };
+    template<>
+    struct register_hook< Widget<0>* > {
+        static void on_register(lua_State *L) { add_widget_methods<Widget<0>, false>(L); }
+    };
+    template<>
+    struct register_hook< const Widget<0>* > {
+        static void on_register(lua_State *L) { add_widget_methods<Widget<0>, true>(L); }
+    };
+    template<>
+    struct register_hook< std::shared_ptr< Widget<0> > > {
+        static void on_register(lua_State *L) { add_widget_methods<Widget<0>, false>(L); }
+    };
+    template<>
+    struct register_hook< std::shared_ptr< const Widget<0> > > {
+        static void on_register(lua_State *L) { add_widget_methods<Widget<0>, true>(L); }
+    };
+
+    // Widget<1> registers its methods once for all variants
+    template<>
+    struct class_hook< Widget<1> > {
+        static void on_register(lua_State *L)
+        {
+            typedef Widget<1> T;
+            add_method(L, "get_a", &T::get_a);
+            add_method(L, "get_b", &T::get_b);
+            add_method(L, "get_c", &T::get_c);
+            add_method(L, "get_d", &T::get_d);
+            add_method(L, "set_a", &T::set_a);
+            add_method(L, "set_b", &T::set_b);
+            add_method(L, "set_c", &T::set_c);
+            add_method(L, "set_d", &T::set_d);
+        }
+    };
+}
+
+// Widget<2> binds its data members as fields
+namespace luacpp11 {
+    template<>
+    struct class_hook< Widget<2> > {
+        static void on_register(lua_State *L)
+        {
+            typedef Widget<2> T;
+            add_method(L, "get_a", &T::get_a);
+            add_method(L, "set_a", &T::set_a);
+            add_field(L, "a", &T::a);
+            add_field(L, "b", &T::b);
+            add_field(L, "c", &T::c);
+            add_field(L, "d", &T::d);
+        }
+    };
+}
+
+// field access vs getter and setter methods
+void bench_fields(lua_State *L)
+{
+    luacpp11::emplace< Widget<1> >(L);
+    lua_setglobal(L, "w1");
+    luacpp11::emplace< Widget<2> >(L);
+    lua_setglobal(L, "w2");
+
+    run(L, "getter/setter methods",
+        "local w = w1 w:set_a(0)\n"
+        "for i = 1, 10000000 do w:set_a(w:get_a() + 1) end\n"
+    );
+    run(L, "fields",
+        "local w = w2 w.a = 0\n"
+        "for i = 1, 10000000 do w.a = w.a + 1 end\n"
+    );
+    run(L, "methods on a class with fields",
+        "local w = w2 w:set_a(0)\n"
+        "for i = 1, 10000000 do w:set_a(w:get_a() + 1) end\n"
+    );
+}
+
+std::vector<int> make_buffer()
+{
+    return std::vector<int>(100000, 1);
+}
+
+size_t consume_copy(std::vector<int> v)
+{
+    return v.size();
+}
+
+size_t consume_move(std::vector<int> &&v)
+{
+    std::vector<int> owned(std::move(v));
+    return owned.size();
+}
+
+// handing a large container from lua to C++ by value vs as rvalue reference
+void bench_sink(lua_State *L)
+{
+    luacpp11::push_callable(L, make_buffer);
+    lua_setglobal(L, "make_buffer");
+    luacpp11::push_callable(L, consume_copy);
+    lua_setglobal(L, "consume_copy");
+    luacpp11::push_callable(L, consume_move);
+    lua_setglobal(L, "consume_move");
+
+    run(L, "by value argument (copy)",
+        "for i = 1, 10000 do consume_copy(make_buffer()) end\n"
+    );
+    run(L, "rvalue reference argument (move)",
+        "for i = 1, 10000 do consume_move(make_buffer()) end\n"
+    );
+}
+
+// a large C++ object that only occupies a few bytes of lua memory
+template<int N>
+struct Buffer {
+    Buffer() : data(1 << 20) { peak = std::max(peak, ++alive); }
+    ~Buffer() { --alive; }
+    std::vector<char> data;
+    static int alive, peak;
+};
+
+template<int N>
+int Buffer<N>::alive = 0;
+template<int N>
+int Buffer<N>::peak = 0;
+
+namespace luacpp11 {
+    // only Buffer<1> reports its memory to the collector
+    template<>
+    struct memory_size< Buffer<1> > {
+        static size_t get(const Buffer<1> &buffer) { return buffer.data.capacity(); }
+    };
+}
+
+template<int N>
+luacpp11::luareturn make_buffer(lua_State *L)
+{
+    luacpp11::emplace< Buffer<N> >(L);
+    return luacpp11::luareturn(1);
+}
+
+// peak number of live 1 MB buffers while a script creates garbage ones
+template<int N>
+void bench_memory_size(lua_State *L, const char *name)
+{
+    luacpp11::push_callable(L, make_buffer<N>);
+    lua_setglobal(L, "make_buffer");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    run(L, name,
+        "for i = 1, 1000 do make_buffer() end\n"
+    );
+    std::cout << "  peak live buffers: " << Buffer<N>::peak << std::endl;
+}
+
+// an object whose destructor releases an expensive resource. Moved-from
+// objects don't own it anymore.
+template<int N>
+struct Heavy {
+    Heavy() : owner(true) { }
+    Heavy(Heavy &&that) : owner(that.owner) { that.owner = false; }
+    ~Heavy()
+    {
+        volatile long sum = 0;
+        for(long i = 0; owner && i < 10000; ++i)
+            sum += i;
+    }
+    bool owner;
+};
+
+namespace luacpp11 {
+    template<>
+    struct destruction_policy< Heavy<1> > { typedef deferred_destruction type; };
+    template<>
+    struct destruction_policy< Heavy<2> > { typedef background_destruction type; };
+}
+
+template<int N>
+luacpp11::luareturn make_heavy(lua_State *L)
+{
+    luacpp11::emplace< Heavy<N> >(L);
+    return luacpp11::luareturn(1);
+}
+
+// time spent in a full collection that frees 10000 heavy objects
+template<int N>
+void bench_destruction(lua_State *L, const char *name)
+{
+    luacpp11::push_callable(L, make_heavy<N>);
+    lua_setglobal(L, "make_heavy");
+    lua_gc(L, LUA_GCSTOP, 0);
+    luaL_dostring(L, "for i = 1, 10000 do make_heavy() end");
+    run(L, name, "collectgarbage()");
+    lua_gc(L, LUA_GCRESTART, 0);
+}
+
+void bench_destruction(lua_State *L)
+{
+    bench_destruction<0>(L, "collection with immediate destruction");
+    bench_destruction<1>(L, "collection with deferred destruction");
+    auto start = std::chrono::steady_clock::now();
+    while(luacpp11::destroy_deferred(L, 100) > 0) { }
+    std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+    std::cout << "  draining in slices of 100: " << ms.count() << " ms, peak queue "
+              << luacpp11::deferred_stats(L).peak_pending << std::endl;
+    bench_destruction<2>(L, "collection with background destruction");
+}
+
+struct Record {
+    double price;
+    int qty;
+    std::string name;
+    bool paid;
+};
+
+namespace luacpp11 {
+    template<>
+    struct table_schema<Record> {
+        template<class S>
+        static void describe(S &s)
+        {
+            s.field("price", &Record::price)
+             .field("qty", &Record::qty)
+             .field("name", &Record::name)
+             .field("paid", &Record::paid);
+        }
+    };
+}
+
+// decodes the records in the table at index 1 with lua_getfield
+luacpp11::luareturn decode_getfield(lua_State *L)
+{
+    double sum = 0;
+    for(int i = 1; ; ++i)
+    {
+        lua_rawgeti(L, 1, i);
+        if(lua_isnil(L, -1))
+            break;
+        Record record;
+        lua_getfield(L, -1, "price");
+        record.price = lua_tonumber(L, -1);
+        lua_getfield(L, -2, "qty");
+        record.qty = lua_tointeger(L, -1);
+        lua_getfield(L, -3, "name");
+        record.name = lua_tostring(L, -1);
+        lua_getfield(L, -4, "paid");
+        record.paid = lua_toboolean(L, -1);
+        lua_pop(L, 5);
+        sum += record.price*record.qty;
+    }
+    lua_pushnumber(L, sum);
+    return luacpp11::luareturn(1);
+}
+
+// same as decode_getfield, but checks the types like the table schema does
+luacpp11::luareturn decode_checked(lua_State *L)
+{
+    double sum = 0;
+    for(int i = 1; ; ++i)
+    {
+        lua_rawgeti(L, 1, i);
+        if(lua_isnil(L, -1))
+            break;
+        if(!lua_istable(L, -1))
+            luaL_error(L, "element %d: table expected", i);
+        Record record;
+        lua_getfield(L, -1, "price");
+        if(lua_type(L, -1) != LUA_TNUMBER)
+            luaL_error(L, "element %d: field 'price': number expected", i);
+        record.price = lua_tonumber(L, -1);
+        lua_getfield(L, -2, "qty");
+        if(lua_type(L, -1) != LUA_TNUMBER)
+            luaL_error(L, "element %d: field 'qty': number expected", i);
+        record.qty = lua_tointeger(L, -1);
+        lua_getfield(L, -3, "name");
+        if(lua_type(L, -1) != LUA_TSTRING)
+            luaL_error(L, "element %d: field 'name': string expected", i);
+        size_t length;
+        const char *name = lua_tolstring(L, -1, &length);
+        record.name.assign(name, length);
+        lua_getfield(L, -4, "paid");
+        if(lua_type(L, -1) != LUA_TBOOLEAN)
+            luaL_error(L, "element %d: field 'paid': boolean expected", i);
+        record.paid = lua_toboolean(L, -1);
+        lua_pop(L, 5);
+        sum += record.price*record.qty;
+    }
+    lua_pushnumber(L, sum);
+    return luacpp11::luareturn(1);
+}
+
+// decodes the records in the table at index 1 with the table schema
+luacpp11::luareturn decode_schema(lua_State *L)
+{
+    double sum = 0;
+    for(int i = 1; ; ++i)
+    {
+        lua_rawgeti(L, 1, i);
+        if(lua_isnil(L, -1))
+            break;
+        Record record = luacpp11::to<Record>(L, -1);
+        lua_pop(L, 1);
+        sum += record.price*record.qty;
+    }
+    lua_pushnumber(L, sum);
+    return luacpp11::luareturn(1);
+}
+
+// decoding a million records from tables
+void bench_schema(lua_State *L)
+{
+    luacpp11::push_callable(L, decode_getfield);
+    lua_setglobal(L, "decode_getfield");
+    luacpp11::push_callable(L, decode_checked);
+    lua_setglobal(L, "decode_checked");
+    luacpp11::push_callable(L, decode_schema);
+    lua_setglobal(L, "decode_schema");
+    luaL_dostring(L,
+        "records = {}\n"
+        "for i = 1, 1000000 do records[i] = {price = i*0.5, qty = i%10, name = 'item', paid = true} end\n"
+    );
+    run(L, "decode with lua_getfield", "decode_getfield(records)");
+    run(L, "decode with checked lua_getfield", "decode_checked(records)");
+    run(L, "decode with table_schema", "decode_schema(records)");
+    luaL_dostring(L, "records = nil");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+const luacpp11::key velocity_key("velocity");
+
+// pushes a constant string 10M times in different ways
+luacpp11::luareturn push_pushstring(lua_State *L)
+{
+    for(int i = 0; i < 10000000; ++i)
+    {
+        lua_pushstring(L, "velocity");
+        lua_pop(L, 1);
+    }
+    return luacpp11::luareturn(0);
+}
+
+luacpp11::luareturn push_pushliteral(lua_State *L)
+{
+    for(int i = 0; i < 10000000; ++i)
+    {
+        lua_pushliteral(L, "velocity");
+        lua_pop(L, 1);
+    }
+    return luacpp11::luareturn(0);
+}
+
+luacpp11::luareturn push_key(lua_State *L)
+{
+    for(int i = 0; i < 10000000; ++i)
+    {
+        velocity_key.push(L);
+        lua_pop(L, 1);
+    }
+    return luacpp11::luareturn(0);
+}
+
+luacpp11::luareturn push_key_table(lua_State *L)
+{
+    luacpp11::key::push_table(L);
+    int keys = lua_gettop(L);
+    for(int i = 0; i < 10000000; ++i)
+    {
+        velocity_key.push(L, keys);
+        lua_pop(L, 1);
+    }
+    return luacpp11::luareturn(0);
+}
+
+// pushing interned keys
+void bench_keys(lua_State *L)
+{
+    luacpp11::push_callable(L, push_pushstring);
+    lua_setglobal(L, "push_pushstring");
+    luacpp11::push_callable(L, push_pushliteral);
+    lua_setglobal(L, "push_pushliteral");
+    luacpp11::push_callable(L, push_key);
+    lua_setglobal(L, "push_key");
+    luacpp11::push_callable(L, push_key_table);
+    lua_setglobal(L, "push_key_table");
+    run(L, "lua_pushstring", "push_pushstring()");
+    run(L, "lua_pushliteral", "push_pushliteral()");
+    run(L, "key::push", "push_key()");
+    run(L, "key::push with key table", "push_key_table()");
+}
+
+double sum_varargs(luacpp11::varargs<double> values)
+{
+    double sum = 0;
+    for(double v : values)
+        sum += v;
+    return sum;
+}
+
+luacpp11::luareturn sum_stack(lua_State *L)
+{
+    double sum = 0;
+    for(int i = 1; i <= lua_gettop(L); ++i)
+        sum += luaL_checknumber(L, i);
+    lua_pushnumber(L, sum);
+    return luacpp11::luareturn(1);
+}
+
+// variadic functions with varargs against walking the stack by hand
+void bench_varargs(lua_State *L)
+{
+    luacpp11::push_callable(L, sum_varargs);
+    lua_setglobal(L, "sum_varargs");
+    luacpp11::push_callable(L, sum_stack);
+    lua_setglobal(L, "sum_stack");
+    run(L, "sum with lua_State*", "local s = 0 for i = 1, 1000000 do s = s + sum_stack(i, 2, 3, 4, 5, 6, 7, 8) end");
+    run(L, "sum with varargs", "local s = 0 for i = 1, 1000000 do s = s + sum_varargs(i, 2, 3, 4, 5, 6, 7, 8) end");
+}
+
+// calls the global function name with n and prints how long it took
+void time_call(lua_State *L, const char *label, const char *name, double n, luacpp11::budget *b)
+{
+    lua_getglobal(L, name);
+    lua_pushnumber(L, n);
+    auto start = std::chrono::steady_clock::now();
+    int result = b != nullptr ? luacpp11::pcall(L, 1, 0, 0, *b) : lua_pcall(L, 1, 0, 0);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> ms = end - start;
+    std::cout << label << ": " << ms.count() << " ms";
+    if(result)
+    {
+        std::cout << " (" << lua_tostring(L, -1) << ")";
+        lua_pop(L, 1);
+    }
+    std::cout << std::endl;
+}
+
+// overhead of the count hook of execution budgets
+void bench_budget(lua_State *L)
+{
+    luaL_dostring(L, "function count_to(n) local s = 0 for i = 1, n do s = s + i%7 end return s end");
+    luacpp11::budget unlimited(0);
+    luacpp11::budget limited(1000000);
+    time_call(L, "10M iterations with lua_pcall", "count_to", 1e7, nullptr);
+    time_call(L, "10M iterations with unlimited budget", "count_to", 1e7, &unlimited);
+    time_call(L, "10M iterations with budget of 1M instructions", "count_to", 1e7, &limited);
+}
+
+// returns a bound method like a dynamic __index function would
+template<bool Cached>
+luacpp11::luareturn lookup_method(lua_State *L)
+{
+    if(Cached)
+        luacpp11::push_cached_callable(L, &Widget<2>::get_a);
+    else
+        luacpp11::push_callable(L, &Widget<2>::get_a);
+    return luacpp11::luareturn(1);
+}
+
+// pushing the same function repeatedly
+void bench_closure_cache(lua_State *L)
+{
+    luacpp11::push_callable(L, lookup_method<false>);
+    lua_setglobal(L, "lookup_plain");
+    luacpp11::push_callable(L, lookup_method<true>);
+    lua_setglobal(L, "lookup_cached");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    run(L, "1M lookups with push_callable", "for i = 1, 1000000 do local f = lookup_plain('get_a') end collectgarbage()");
+    run(L, "1M lookups with push_cached_callable", "for i = 1, 1000000 do local f = lookup_cached('get_a') end collectgarbage()");
+    luacpp11::cache_stats stats = luacpp11::closure_cache_stats();
+    std::cout << "  " << stats.hits << " hits, " << stats.misses << " misses" << std::endl;
+}
+
+// a block of samples, Align 64 puts it on a cache line as SIMD kernels want
+template<size_t Align>
+struct alignas(Align) Samples {
+    Samples() { std::fill(data, data + 4096, 1.0f); }
+    float data[4096];
+};
+
+template<size_t Align>
+void scale_samples(Samples<Align> &samples, float factor)
+{
+    for(float &v : samples.data)
+        v = v*factor + 1.0f;
+}
+
+template<size_t Align>
+int cache_line_offset(const Samples<Align> &samples)
+{
+    return static_cast<int>(reinterpret_cast<uintptr_t>(samples.data) % 64);
+}
+
+// a kernel over userdata of an over-aligned type and the same type with
+// the alignment of float
+template<size_t Align>
+void bench_alignment(lua_State *L, const char *name)
+{
+    luacpp11::push_callable(L, scale_samples<Align>);
+    lua_setglobal(L, "scale");
+    luacpp11::push_callable(L, cache_line_offset<Align>);
+    lua_setglobal(L, "offset");
+    lua_createtable(L, 16, 0);
+    for(int i = 1; i <= 16; ++i)
+    {
+        luacpp11::emplace< Samples<Align> >(L);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setglobal(L, "blocks");
+    luaL_dostring(L,
+        "local offsets = {}\n"
+        "for i = 1, 16 do offsets[i] = offset(blocks[i]) end\n"
+        "print('  cache line offsets: ' .. table.concat(offsets, ' '))\n"
+    );
+    run(L, name, "for i = 1, 100000 do scale(blocks[i%16 + 1], 0.5) end");
+    luaL_dostring(L, "blocks = nil");
+}
+
+// parsing 100k records of four big endian u32 from a string and a buffer
+void bench_buffer(lua_State *L)
+{
+    luacpp11::buffer records(100000*16);
+    for(size_t i = 0; i < 100000*4; ++i)
+        records.write<uint32_t>(i*4, static_cast<uint32_t>(i), luacpp11::endian::big);
+    luacpp11::push(L, records.str());
+    lua_setglobal(L, "records_string");
+    luacpp11::push(L, records);
+    lua_setglobal(L, "records_buffer");
+    run(L, "100k records with string.sub and string.byte",
+        "local s, total = records_string, 0\n"
+        "for o = 1, #s, 16 do\n"
+        "    local r = s:sub(o, o + 15)\n"
+        "    for f = 1, 13, 4 do\n"
+        "        local a, b, c, d = r:byte(f, f + 3)\n"
+        "        total = total + ((a*256 + b)*256 + c)*256 + d\n"
+        "    end\n"
+        "end\n");
+    run(L, "100k records with string.byte",
+        "local s, total = records_string, 0\n"
+        "for o = 1, #s, 4 do\n"
+        "    local a, b, c, d = s:byte(o, o + 3)\n"
+        "    total = total + ((a*256 + b)*256 + c)*256 + d\n"
+        "end\n");
+    run(L, "100k records with buffer:read",
+        "local b, total = records_buffer, 0\n"
+        "for o = 0, #b - 1, 4 do total = total + b:read('u32be', o) end\n");
+}
+
+template<class T>
+void create_all_metatables(lua_State *L)
+{
+    luacpp11::getmetatable<T>(L);
+    luacpp11::getmetatable<const T>(L);
+    luacpp11::getmetatable<T*>(L);
+    luacpp11::getmetatable<const T*>(L);
+    luacpp11::getmetatable< std::shared_ptr<T> >(L);
+    luacpp11::getmetatable< std::shared_ptr<const T> >(L);
+    lua_pop(L, 6);
+}
+
+// memory in use by the lua state in kilobytes
+double kbytes_in_use(lua_State *L)
+{
+    return lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0)/1024.0;
+}
+
+// holds the values of the array at index 1 as T (ref or value) and pushes
+// them back into a new table
+template<class T>
+void bench_hold(lua_State *L, const char *name)
+{
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    double before = kbytes_in_use(L);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<T> held;
+    for(int i = 1; ; ++i)
+    {
+        lua_rawgeti(L, 1, i);
+        if(lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            break;
+        }
+        held.push_back(luacpp11::to<T>(L, -1));
+        lua_pop(L, 1);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    lua_createtable(L, held.size(), 0);
+    for(size_t i = 0; i < held.size(); ++i)
+    {
+        luacpp11::push(L, held[i]);
+        lua_rawseti(L, -2, i+1);
+    }
+    auto end = std::chrono::steady_clock::now();
+    lua_pop(L, 1);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    double lua_kb = kbytes_in_use(L) - before;
+    std::chrono::duration<double, std::milli> hold = middle - start;
+    std::chrono::duration<double, std::milli> push = end - middle;
+    std::cout << name << ": hold " << hold.count() << " ms, push " << push.count() << " ms, "
+              << held.size()*sizeof(T)/1024 << " kB in C++, " << lua_kb << " kB in lua" << std::endl;
+}
+
+// holding 1M numbers, booleans and short strings
+void bench_value()
+{
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    luaL_dostring(L,
+        "values = {}\n"
+        "for i = 1, 1000000 do\n"
+        "    local k = i % 4\n"
+        "    values[i] = k == 0 and i*0.5 or k == 1 and i or k == 2 and 'key' .. i % 1000 or i % 3 == 0\n"
+        "end\n"
+    );
+    lua_getglobal(L, "values");
+    bench_hold<luacpp11::ref>(L, "1M values as ref");
+    bench_hold<luacpp11::value>(L, "1M values as value");
+    lua_close(L);
+}
+
+#ifdef LUACPP11_HAS_MAP_FILE
+// counts the bytes of the lines of a 20MB file read into lua and mapped
+void bench_map_file()
+{
+    const char *path = "benchmark_lines.txt";
+    {
+        std::ofstream file(path);
+        for(int i = 0; i < 400000; ++i)
+            file << "line " << i << " of the log file with some padding text\n";
+    }
+    const char *scripts[][2] = {
+        {"io.read of the file", "local f = io.open(path, 'rb') local s = f:read('*a') f:close()\n"
+                                "local total, start = 0, 1\n"
+                                "while true do\n"
+                                "    local stop = s:find('\\n', start, true)\n"
+                                "    if not stop then break end\n"
+                                "    total = total + stop - start start = stop + 1\n"
+                                "end\n"
+                                "peak = collectgarbage('count')\n"},
+        {"io.lines", "local total = 0 for l in io.lines(path) do total = total + #l end peak = collectgarbage('count')\n"},
+        {"buffer.map and lines", "local m = buffer.map(path) local total = 0\n"
+                                 "for o, n in m:lines() do total = total + n end\n"
+                                 "peak = collectgarbage('count') m:close()\n"}
+    };
+    for(auto &script : scripts)
+    {
+        lua_State *L = luaL_newstate();
+        luaL_openlibs(L);
+        luacpp11::push_module(L, luacpp11::buffer_module());
+        lua_setglobal(L, "buffer");
+        lua_pushstring(L, path);
+        lua_setglobal(L, "path");
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        double before = kbytes_in_use(L);
+        run(L, script[0], script[1]);
+        lua_getglobal(L, "peak");
+        std::cout << "  " << lua_tonumber(L, -1) - before << " kB in use at the end" << std::endl;
+        lua_close(L);
+    }
+    std::remove(path);
+}
+#endif
+
+bool expired(const luacpp11::ref&) { return false; }
+bool expired(const luacpp11::weak_ref &object) { return object.expired(); }
+
+// a C++ cache of 200k script tables of which the script keeps the last 100
+// alive, held as T (ref or weak_ref)
+template<class T>
+void bench_cache(const char *name)
+{
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    std::vector<T> cache;
+    luacpp11::push_callable<void(T)>(L, [&cache](T object) { cache.push_back(std::move(object)); });
+    lua_setglobal(L, "remember");
+    luacpp11::push_callable<bool(int)>(L, [&cache](int i) { return expired(cache[i]); });
+    lua_setglobal(L, "expired");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    double before = kbytes_in_use(L);
+    run(L, name,
+        "local recent = {}\n"
+        "for i = 1, 200000 do\n"
+        "    local object = {id = i, payload = {1, 2, 3, 4}}\n"
+        "    remember(object)\n"
+        "    recent[i % 100] = object\n"
+        "end\n"
+        "alive = 0\n"
+        "collectgarbage()\n"
+        "for i = 0, 199999 do if not expired(i) then alive = alive + 1 end end\n");
+    lua_getglobal(L, "alive");
+    std::cout << "  " << lua_tointeger(L, -1) << " alive, " << kbytes_in_use(L) - before << " kB in lua" << std::endl;
+    lua_pop(L, 1);
+    cache.clear();
+    lua_close(L);
+}
+
+// 2d vectors whose operators are wired by hand (N = 0) or with
+// operator_metamethods (N = 1)
+template<int N>
+struct vec2 {
+    double x, y;
+    vec2 operator+(const vec2 &o) const { return vec2{x + o.x, y + o.y}; }
+    vec2 operator*(double s) const { return vec2{x*s, y*s}; }
+    bool operator<(const vec2 &o) const { return x*x + y*y < o.x*o.x + o.y*o.y; }
+};
+
+namespace luacpp11 {
+    template<>
+    struct register_hook< vec2<0> > {
+        static void on_register(lua_State *L)
+        {
+            typedef vec2<0> V;
+            lua_pushstring(L, "__add");
+            push_callable<V(const V&, const V&)>(L, [](const V &a, const V &b) { return a + b; });
+            lua_rawset(L, -3);
+            lua_pushstring(L, "__mul");
+            push_callable<V(const V&, double)>(L, [](const V &a, double s) { return a*s; });
+            lua_rawset(L, -3);
+            lua_pushstring(L, "__lt");
+            push_callable<bool(const V&, const V&)>(L, [](const V &a, const V &b) { return a < b; });
+            lua_rawset(L, -3);
+        }
+    };
+
+    template<>
+    struct operator_metamethods< vec2<1> > : std::true_type { };
+}
+
+// 1M iterations of an add, a scale and a comparison
+template<int N>
+void bench_operators(lua_State *L, const char *name)
+{
+    luacpp11::push(L, vec2<N>{1, 2});
+    lua_setglobal(L, "v");
+    run(L, name, "local a, n = v, 0 for i = 1, 1000000 do local b = (a + a)*0.5 if a < b then n = n + 1 end end");
+}
+
+std::vector<double> range_samples(100000, 0.5);
+
+luacpp11::luareturn samples_table(lua_State *L)
+{
+    lua_createtable(L, static_cast<int>(range_samples.size()), 0);
+    for(size_t i = 0; i < range_samples.size(); ++i)
+    {
+        lua_pushnumber(L, range_samples[i]);
+        lua_rawseti(L, -2, static_cast<int>(i + 1));
+    }
+    return luacpp11::luareturn(1);
+}
+
+luacpp11::luareturn samples_range(lua_State *L)
+{
+    luacpp11::push_range(L, range_samples.begin(), range_samples.end());
+    return luacpp11::luareturn(1);
+}
+
+// 100 loops over 100k samples that stop after 10 elements or run through
+void bench_ranges(lua_State *L)
+{
+    luacpp11::push_callable(L, samples_table);
+    lua_setglobal(L, "samples_table");
+    luacpp11::push_callable(L, samples_range);
+    lua_setglobal(L, "samples_range");
+    run(L, "100 early exits from a copied table",
+        "for r = 1, 100 do for i, x in ipairs(samples_table()) do if i == 10 then break end end end");
+    run(L, "100 early exits from push_range",
+        "for r = 1, 100 do for i, x in samples_range() do if i == 10 then break end end end");
+    run(L, "100 full loops over a copied table",
+        "local s = 0 for r = 1, 100 do for i, x in ipairs(samples_table()) do s = s + x end end");
+    run(L, "100 full loops over push_range",
+        "local s = 0 for r = 1, 100 do for i, x in samples_range() do s = s + x end end");
+}
+
+// lua allocator that counts allocations
+void* counting_alloc(void *ud, void *ptr, size_t, size_t nsize)
+{
+    if(nsize == 0)
+    {
+        std::free(ptr);
+        return nullptr;
+    }
+    if(ptr == nullptr)
+        ++*static_cast<size_t*>(ud);
+    return std::realloc(ptr, nsize);
+}
+
+struct vec3 {
+    double x, y, z;
+};
+
+// the same with a destructor, so its userdata have a finalizer
+struct finalized_vec3 {
+    ~finalized_vec3() { }
+    double x, y, z;
+};
+
+template<class V>
+V add_vec3(const V &a, const V &b)
+{
+    V result;
+    result.x = a.x + b.x;
+    result.y = a.y + b.y;
+    result.z = a.z + b.z;
+    return result;
+}
+
+namespace luacpp11 {
+    template<>
+    struct result_destination<vec3> : std::true_type { };
+}
+
+// 1M additions of userdata vectors with the collector stopped, then the time
+// of collecting the garbage
+template<class V>
+void bench_vec3(const char *name, const char *script)
+{
+    size_t allocations = 0;
+    lua_State *L = lua_newstate(counting_alloc, &allocations);
+    bool counted = L != nullptr;
+    if(!counted)
+        L = luaL_newstate();
+    luaL_openlibs(L);
+    luacpp11::push_callable(L, add_vec3<V>);
+    lua_setglobal(L, "add");
+    luacpp11::push(L, V());
+    lua_setglobal(L, "a");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    lua_gc(L, LUA_GCSTOP, 0);
+    allocations = 0;
+    run(L, name, script);
+    size_t made = allocations;
+    auto start = std::chrono::steady_clock::now();
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+    std::cout << "  ";
+    if(counted)
+        std::cout << made << " allocations, ";
+    std::cout << "collecting took " << ms.count() << " ms" << std::endl;
+    lua_close(L);
+}
+
+// startup cost and memory of registering a type with all six variants
+template<class T>
+void bench_registration(const char *name)
+{
+    const int states = 1000;
+    double kbytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < states; ++i)
+    {
+        lua_State *L = luaL_newstate();
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        double before = kbytes_in_use(L);
+        create_all_metatables<T>(L);
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        kbytes += kbytes_in_use(L) - before;
+        lua_close(L);
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> ms = end - start;
+    std::cout << name << ": " << ms.count() << " ms for " << states << " states, "
+              << kbytes/states << " kB per state" << std::endl;
+}
+
+// registers 10k functions in three ways and prints the time per state
+template<class F>
+void bench_module_registration(const char *name, F f)
+{
+    const int states = 20;
+    std::chrono::duration<double, std::milli> total(0);
+    for(int i = 0; i < states; ++i)
+    {
+        lua_State *L = luaL_newstate();
+        auto start = std::chrono::steady_clock::now();
+        f(L);
+        total += std::chrono::steady_clock::now() - start;
+        lua_close(L);
+    }
+    std::cout << name << ": " << total.count()/states << " ms" << std::endl;
+}
+
+std::vector<std::string> module_names;
+std::vector<luacpp11::module_entry> module_entries;
+
+// 10k entries of a module, all bound to the same function
+void make_module_entries()
+{
+    for(int i = 0; i < 10000; ++i)
+        module_names.push_back("function" + std::to_string(i));
+    for(const std::string &name : module_names)
+        module_entries.push_back(LUACPP11_FUNCTION(name.c_str(), add));
+    module_entries.push_back(luacpp11::module_entry());
+}
+
+void register_push_callable(lua_State *L)
+{
+    lua_newtable(L);
+    for(const std::string &name : module_names)
+    {
+        luacpp11::push_callable(L, add);
+        lua_setfield(L, -2, name.c_str());
+    }
+    lua_setglobal(L, "api");
+}
+
+void register_module(lua_State *L)
+{
+    luacpp11::push_module(L, module_entries.data());
+    lua_setglobal(L, "api");
+}
+
+void register_lazy_module(lua_State *L)
+{
+    luacpp11::push_lazy_module(L, module_entries.data());
+    lua_setglobal(L, "api");
+    luaL_dostring(L, "for i = 0, 9 do local f = api['function' .. i] end");
+}
+
+void bench_modules()
+{
+    make_module_entries();
+    bench_module_registration("10k functions with push_callable", register_push_callable);
+    bench_module_registration("10k functions with push_module", register_module);
+    bench_module_registration("10k functions with push_lazy_module, 10 used", register_lazy_module);
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    bench_ffi(L);
+    bench_policies(L);
+    bench_fields(L);
+    bench_sink(L);
+    bench_memory_size<0>(L, "buffers without memory_size");
+    bench_memory_size<1>(L, "buffers with memory_size");
+    bench_destruction(L);
+    bench_schema(L);
+    bench_keys(L);
+    bench_varargs(L);
+    bench_budget(L);
+    bench_closure_cache(L);
+    bench_alignment<4>(L, "100k kernels over alignof(float) samples");
+    bench_alignment<64>(L, "100k kernels over alignas(64) samples");
+    bench_buffer(L);
+    bench_operators<0>(L, "1M vector expressions with std::function metamethods");
+    bench_operators<1>(L, "1M vector expressions with operator_metamethods");
+    bench_ranges(L);
+
+    lua_close(L);
+
+    bench_registration< Widget<0> >("register_hook per variant");
+    bench_registration< Widget<1> >("class_hook");
+
+    bench_value();
+    bench_cache<luacpp11::ref>("cache of 200k tables with ref");
+    bench_cache<luacpp11::weak_ref>("cache of 200k tables with weak_ref");
+    bench_vec3<finalized_vec3>("1M vec3 additions with finalizer", "local c for i = 1, 1000000 do c = add(a, a) end");
+    bench_vec3<vec3>("1M vec3 additions without finalizer", "local c for i = 1, 1000000 do c = add(a, a) end");
+    bench_vec3<vec3>("1M vec3 additions into a destination", "local c = add(a, a) for i = 1, 1000000 do c = add(a, a, c) end");
+    bench_modules();
+#ifdef LUACPP11_HAS_MAP_FILE
+    bench_map_file();
+#endif
+
+    luacpp11::stop_background_destruction();
+
+    return 0;
+}
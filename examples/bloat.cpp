@@ -0,0 +1,99 @@
+// compile time and object size benchmark for a binding heavy translation
+// unit. The X-macros below bind 4 methods and 2 free functions for each of
+// 256 classes, i.e. 1536 functions with distinct signatures. Measure with
+//   time g++ -std=c++11 -O2 -c examples/bloat.cpp && size bloat.o
+#include <iostream>
+#include <string>
+
+#include <lua.hpp>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "luacpp11.hpp"
+
+template<int N>
+struct Obj {
+    Obj() : value(N), scale(1.0) { }
+    int get() const { return value; }
+    void set(int v) { value = v; }
+    double scaled(double factor) const { return value*scale*factor; }
+    std::string name() const { return "obj" + std::to_string(N); }
+    int value;
+    double scale;
+};
+
+template<int N>
+int sum(const Obj<N> &a, const Obj<N> *b, int c)
+{
+    return a.value + b->value + c;
+}
+
+template<int N>
+luacpp11::luareturn make(lua_State *L)
+{
+    luacpp11::emplace< Obj<N> >(L);
+    return luacpp11::luareturn(1);
+}
+
+namespace luacpp11 {
+    template<int N>
+    struct class_hook< Obj<N> > {
+        static void on_register(lua_State *L)
+        {
+            add_method(L, "get", &Obj<N>::get);
+            add_method(L, "set", &Obj<N>::set);
+            add_method(L, "scaled", &Obj<N>::scaled);
+            add_method(L, "name", &Obj<N>::name);
+        }
+    };
+}
+
+template<int N>
+void bind(lua_State *L)
+{
+    lua_pushinteger(L, N);
+    lua_createtable(L, 0, 2);
+    lua_pushstring(L, "make");
+    luacpp11::push_callable(L, make<N>);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "sum");
+    luacpp11::push_callable(L, sum<N>);
+    lua_rawset(L, -3);
+    lua_rawset(L, -3);
+}
+
+#define X4(N) X(N) X(N+1) X(N+2) X(N+3)
+#define X16(N) X4(N) X4(N+4) X4(N+8) X4(N+12)
+#define X64(N) X16(N) X16(N+16) X16(N+32) X16(N+48)
+#define X256(N) X64(N) X64(N+64) X64(N+128) X64(N+192)
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    lua_newtable(L);
+#define X(N) bind<N>(L);
+    X256(0)
+#undef X
+    lua_setglobal(L, "objs");
+
+    int result = luaL_dostring(L,
+        "local total = 0\n"
+        "for i = 0, 255 do\n"
+        "    local o = objs[i].make()\n"
+        "    o:set(o:get() + 1)\n"
+        "    total = total + objs[i].sum(o, o, 1) + o:scaled(2)\n"
+        "end\n"
+        "print(total, objs[255].make():name())\n"
+    );
+    if (result) {
+        std::cerr << "Error: " << lua_tostring(L, -1) << std::endl;
+    }
+
+    lua_close(L);
+
+    return 0;
+}
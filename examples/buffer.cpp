@@ -0,0 +1,76 @@
+#include <iostream>
+#include <string>
+
+#include <lua.hpp>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "luacpp11.hpp"
+
+// a packet with a big endian header: u16 type, u16 payload length
+luacpp11::buffer make_packet(int type, const std::string &payload)
+{
+    luacpp11::buffer packet(4 + payload.size());
+    packet.write<uint16_t>(0, static_cast<uint16_t>(type), luacpp11::endian::big);
+    packet.write<uint16_t>(2, static_cast<uint16_t>(payload.size()), luacpp11::endian::big);
+    packet.write_bytes(4, payload.data(), payload.size());
+    return packet;
+}
+
+// buffers are taken like any other userdata argument
+unsigned checksum(const luacpp11::buffer &bytes)
+{
+    unsigned sum = 0;
+    for(size_t i = 0; i < bytes.size(); ++i)
+        sum += static_cast<unsigned char>(bytes.data()[i]);
+    return sum & 0xffff;
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    luacpp11::push_module(L, luacpp11::buffer_module());
+    lua_setglobal(L, "buffer");
+    luacpp11::push_callable(L, make_packet);
+    lua_setglobal(L, "make_packet");
+    luacpp11::push_callable(L, checksum);
+    lua_setglobal(L, "checksum");
+    lua_pushstring(L, __FILE__);
+    lua_setglobal(L, "source");
+
+    int result = luaL_dostring(L,
+        "local p = make_packet(7, 'hello world')\n"
+        "local length = p:read('u16be', 2)\n"
+        // slices share the bytes of the packet
+        "local payload = p:slice(4, length)\n"
+        "print(#p, p:read('u16be', 0), length, payload:tostring(), payload:find('world'))\n"
+        "print(checksum(payload), checksum(p))\n"
+        "payload:write_bytes(0, 'HELLO')\n"
+        "print(p:slice(4):tostring())\n"
+        "local b = buffer.new(12)\n"
+        "b:write('i32', 0, -1) b:write('f64', 4, 0.25)\n"
+        "print(b:read('i32', 0), b:read('u32', 0), b:read('f64', 4))\n"
+        "print(pcall(b.read, b, 'u32', 10))\n"
+        // mapped files are buffers as well, lines are iterated as offset
+        // and size unless strings are requested
+        "if buffer.map then\n"
+        "    local m = assert(buffer.map(source))\n"
+        "    local lines, longest = 0, 0\n"
+        "    for offset, size in m:lines() do lines = lines + 1 longest = math.max(longest, size) end\n"
+        "    for line in m:lines(true) do io.write(line, ' ') break end\n"
+        "    print(lines, longest, checksum(m) > 0)\n"
+        "    m:close()\n"
+        "end\n"
+    );
+    if (result) {
+        std::cerr << "Error: " << lua_tostring(L, -1) << std::endl;
+    }
+
+    lua_close(L);
+
+    return 0;
+}
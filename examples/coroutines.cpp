@@ -0,0 +1,73 @@
+#include <iostream>
+#include <vector>
+
+#include <lua.hpp>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "luacpp11.hpp"
+
+std::vector<luacpp11::value> values;
+std::vector<luacpp11::weak_ref> weak_refs;
+
+// values and weak_refs are created on the stack of the calling coroutine but
+// keep the main thread, so they stay valid after the coroutine is collected
+void keep(luacpp11::value v)
+{
+    values.push_back(v);
+}
+
+void observe(luacpp11::weak_ref r)
+{
+    weak_refs.push_back(r);
+}
+
+luacpp11::luareturn kept(int i, lua_State *L)
+{
+    luacpp11::push(L, values.at(i));
+    return luacpp11::luareturn(1);
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    luacpp11::push_callable(L, keep);
+    lua_setglobal(L, "keep");
+
+    luacpp11::push_callable(L, observe);
+    lua_setglobal(L, "observe");
+
+    luacpp11::push_callable(L, kept);
+    lua_setglobal(L, "kept");
+
+    int result = luaL_dostring(L,
+        "permanent = {}\n"
+        "coroutine.wrap(function() keep({1, 2, 3}) observe(permanent) observe({}) end)()\n"
+        "local co = coroutine.create(function() keep('a string longer than the inline capacity') end)\n"
+        "coroutine.resume(co)\n"
+        "co = nil\n"
+        "collectgarbage()\n"
+        "collectgarbage()\n"
+        "for i = 1, 100 do coroutine.wrap(function() end)() end\n"
+        "collectgarbage()\n"
+        "print(#kept(0), kept(1))\n"
+    );
+    if (result) {
+        std::cerr << "Error: " << lua_tostring(L, -1) << std::endl;
+    }
+
+    std::cout << "permanent expired: " << weak_refs.at(0).expired() << std::endl;
+    std::cout << "temporary expired: " << weak_refs.at(1).expired() << std::endl;
+
+    // releasing the references touches the thread they keep
+    values.clear();
+    weak_refs.clear();
+
+    lua_close(L);
+
+    return 0;
+}
@@ -17,11 +17,12 @@ luacpp11::luareturn index_metamethod(lua_State *L)
     return 1;
 }
 
-// adds the index metamethod to the table at the top of the stack
+// adds the index metamethod to the table at the top of the stack. All
+// metatables share one closure.
 void add_index_metamethod(lua_State *L)
 {
     lua_pushstring(L, "__index");
-    luacpp11::push_callable(L, index_metamethod);
+    luacpp11::push_cached_callable(L, index_metamethod);
     lua_rawset(L, -3);
 }
 
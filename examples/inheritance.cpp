@@ -0,0 +1,157 @@
+#include <iostream>
+#include <string>
+#include <memory>
+
+#include <lua.hpp>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "luacpp11.hpp"
+
+struct Named {
+    Named(const std::string &name) : name(name) { }
+    std::string get_name() const { return name; }
+    void set_name(const std::string &n) { name = n; }
+    std::string name;
+};
+
+struct Shape {
+    virtual ~Shape() { }
+    virtual double area() const = 0;
+};
+
+// multiple inheritance, the Shape subobject is not at the start of Circle
+struct Circle : Named, Shape {
+    Circle(double r) : Named("circle"), r(r) { }
+    double area() const { return 3.14159*r*r; }
+    double r;
+};
+
+struct Square : Shape {
+    Square(double a) : a(a) { }
+    double area() const { return a*a; }
+    double a;
+};
+
+double total_area(const Shape &a, const Shape *b)
+{
+    return a.area() + b->area();
+}
+
+double radius(const Circle *c)
+{
+    return c->r;
+}
+
+long use_count(std::shared_ptr<Shape> shape)
+{
+    return shape.use_count();
+}
+
+// adds a function to the metatable on top of the stack
+template<class F>
+void add_function(lua_State *L, const char *name, F f)
+{
+    lua_pushstring(L, name);
+    luacpp11::push_callable(L, f);
+    lua_rawset(L, -3);
+}
+
+namespace luacpp11 {
+    // declare the base classes. Circle objects can now be passed as Named
+    // and Shape and its metatables inherit from the base metatables
+    template<>
+    struct base_classes<Circle> : bases<Named, Shape> { };
+    template<>
+    struct base_classes<Square> : bases<Shape> { };
+
+    template<>
+    struct register_hook<Named> {
+        static void on_register(lua_State *L)
+        {
+            // __index is the metatable itself. Since lookups in the metatable
+            // are not raw, derived types find the methods of their bases.
+            lua_pushstring(L, "__index");
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -3);
+            add_function(L, "get_name", &Named::get_name);
+            add_function(L, "set_name", &Named::set_name);
+        }
+    };
+
+    template<>
+    struct register_hook<Shape> {
+        static void on_register(lua_State *L)
+        {
+            lua_pushstring(L, "__index");
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -3);
+            add_function(L, "area", &Shape::area);
+        }
+    };
+
+    template<>
+    struct register_hook<Circle> {
+        static void on_register(lua_State *L)
+        {
+            lua_pushstring(L, "__index");
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -3);
+            add_function(L, "radius", radius);
+        }
+    };
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    luacpp11::push_callable(L, total_area);
+    lua_setglobal(L, "total_area");
+
+    luacpp11::push_callable(L, use_count);
+    lua_setglobal(L, "use_count");
+
+    luacpp11::emplace<Circle>(L, 1.0);
+    lua_setglobal(L, "circle");
+
+    luacpp11::emplace<Square>(L, 2.0);
+    lua_setglobal(L, "square");
+
+    Square square(3.0);
+    luacpp11::push(L, &square);
+    lua_setglobal(L, "square_ptr");
+
+    luacpp11::push(L, std::make_shared<Circle>(2.0));
+    lua_setglobal(L, "shared_circle");
+
+    int result = luaL_dostring(L,
+        // methods of both bases and the type itself
+        "print(circle:get_name(), circle:area(), circle:radius())\n"
+        "circle:set_name('unit circle')\n"
+        "print(circle:get_name())\n"
+        "print(square:area())\n"
+        // derived objects as base reference and pointer arguments
+        "print(total_area(circle, square))\n"
+        "print(total_area(square_ptr, shared_circle))\n"
+        // shared_ptr<Circle> passed as shared_ptr<Shape>
+        "print(use_count(shared_circle))\n"
+    );
+    if (result) {
+        std::cerr << "Error: " << lua_tostring(L, -1) << std::endl;
+    }
+
+    // to<T> converts to base classes as well
+    lua_getglobal(L, "circle");
+    std::cout << luacpp11::to<const Shape>(L, -1).area() << ' ';
+    std::cout << luacpp11::to<Named*>(L, -1)->get_name() << ' ';
+    std::cout << std::boolalpha << luacpp11::isconvertible<Square>(L, -1) << std::endl;
+    lua_pop(L, 1);
+
+    lua_close(L);
+
+    return 0;
+}
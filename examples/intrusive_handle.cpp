@@ -0,0 +1,137 @@
+#include <iostream>
+#include <memory>
+
+#include <lua.hpp>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "luacpp11.hpp"
+
+// engine objects carry their own reference count
+struct Object {
+    Object() : refs(0) { }
+    virtual ~Object() { }
+    mutable int refs;
+};
+
+// intrusive reference counted handle, no separate control block is needed
+template<class T>
+class handle {
+public:
+    handle(T *ptr = nullptr) : ptr(ptr) { acquire(); }
+    handle(const handle &that) : ptr(that.ptr) { acquire(); }
+    ~handle() { release(); }
+    handle& operator=(handle that)
+    {
+        std::swap(ptr, that.ptr);
+        return *this;
+    }
+    T* get() const { return ptr; }
+private:
+    void acquire() { if(ptr) ++ptr->refs; }
+    void release() { if(ptr && --ptr->refs == 0) delete ptr; }
+    T *ptr;
+};
+
+struct Entity : Object {
+    Entity(int id) : id(id) { ++alive; }
+    ~Entity() { --alive; }
+    int get_id() const { return id; }
+    int id;
+    static int alive;
+};
+
+int Entity::alive = 0;
+
+int refs(const Object &object)
+{
+    return object.refs;
+}
+
+handle<Entity> kept;
+
+void keep(handle<Entity> entity)
+{
+    kept = entity;
+}
+
+handle<Entity> spawn(int id)
+{
+    return handle<Entity>(new Entity(id));
+}
+
+int destroy(std::unique_ptr<Entity> &&entity)
+{
+    return entity->id;
+}
+
+namespace luacpp11 {
+    // makes handle a storage kind like T* or std::shared_ptr<T>
+    template<class T>
+    struct storage_traits< handle<T> > {
+        typedef T element_type;
+        static element_type* get(const handle<T> &storage) { return storage.get(); }
+        template<class B>
+        struct rebind {
+            typedef handle<typename std::conditional<std::is_const<T>::value, const B, B>::type> type;
+        };
+    };
+
+    template<>
+    struct base_classes<Entity> : bases<Object> { };
+
+    template<>
+    struct class_hook<Entity> {
+        static void on_register(lua_State *L)
+        {
+            add_method(L, "get_id", &Entity::get_id);
+        }
+    };
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    luacpp11::push_callable(L, spawn);
+    lua_setglobal(L, "spawn");
+    luacpp11::push_callable(L, refs);
+    lua_setglobal(L, "refs");
+    luacpp11::push_callable(L, keep);
+    lua_setglobal(L, "keep");
+    luacpp11::push_callable(L, destroy);
+    lua_setglobal(L, "destroy");
+
+    // unique_ptr is moved into the userdata
+    luacpp11::push(L, std::unique_ptr<Entity>(new Entity(-1)));
+    lua_setglobal(L, "unique");
+
+    int result = luaL_dostring(L,
+        // handles are accepted as the object, its bases and the handle itself
+        "local e = spawn(1)\n"
+        "print(e:get_id(), refs(e))\n"
+        "keep(e)\n"
+        "print(refs(e))\n"
+        "local entities = {}\n"
+        "for i = 1, 100000 do entities[i] = spawn(i) end\n"
+        "print(#entities, entities[100000]:get_id())\n"
+        // unique_ptr&& parameters take the object over
+        "print(unique:get_id(), destroy(unique))\n"
+    );
+    if (result) {
+        std::cerr << "Error: " << lua_tostring(L, -1) << std::endl;
+    }
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    std::cout << Entity::alive << ' ' << kept.get()->refs << std::endl;
+
+    lua_close(L);
+
+    kept = handle<Entity>();
+    std::cout << Entity::alive << std::endl;
+
+    return 0;
+}
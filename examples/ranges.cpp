@@ -0,0 +1,75 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <lua.hpp>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "luacpp11.hpp"
+
+struct Point {
+    Point(double x, double y) : x(x), y(y) { }
+    double x, y;
+};
+
+std::vector<Point> points;
+
+// the loop gets the index and a copy of each point
+luacpp11::luareturn each_point(lua_State *L)
+{
+    luacpp11::push_range(L, points.begin(), points.end());
+    return luacpp11::luareturn(1);
+}
+
+typedef std::map<std::string, int> inventory;
+
+namespace luacpp11 {
+    template<>
+    struct class_hook<Point> {
+        static void on_register(lua_State *L)
+        {
+            add_field(L, "x", &Point::x);
+            add_field(L, "y", &Point::y);
+        }
+    };
+
+    // pairs on an inventory userdata iterates the map
+    template<>
+    struct range_metamethods<inventory> : std::true_type { };
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    for(int i = 0; i < 1000; ++i)
+        points.emplace_back(i, i*i);
+
+    luacpp11::push_callable(L, each_point);
+    lua_setglobal(L, "each_point");
+
+    luacpp11::push(L, inventory{{"apples", 3}, {"pears", 5}});
+    lua_setglobal(L, "stock");
+
+    int result = luaL_dostring(L,
+        // only the points up to the first match are converted
+        "for i, p in each_point() do\n"
+        "    if p.y > 50 then print(i, p.x, p.y) break end\n"
+        "end\n"
+#if LUA_VERSION_NUM >= 502
+        "for name, count in pairs(stock) do print(name, count) end\n"
+#endif
+    );
+    if (result) {
+        std::cerr << "Error: " << lua_tostring(L, -1) << std::endl;
+    }
+
+    lua_close(L);
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include <iostream>
+#include <string>
+#include <numeric>
+
+#include <lua.hpp>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "luacpp11.hpp"
+
+struct Point {
+    Point(double x, double y) : x(x), y(y) { }
+    double x, y;
+};
+
+// varargs takes all remaining arguments and converts them when accessed
+double sum(luacpp11::varargs<double> values)
+{
+    return std::accumulate(values.begin(), values.end(), 0.0);
+}
+
+// it can follow fixed arguments
+std::string join(const std::string &separator, luacpp11::varargs<std::string> parts)
+{
+    std::string result;
+    for(size_t i = 0; i < parts.size(); ++i)
+    {
+        if(i > 0)
+            result += separator;
+        result += parts[i];
+    }
+    return result;
+}
+
+// userdata elements are references to the objects
+double centroid_x(luacpp11::varargs<const Point&> points)
+{
+    double x = 0;
+    for(const Point &p : points)
+        x += p.x;
+    return points.empty() ? 0 : x/points.size();
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    luacpp11::push_callable(L, sum);
+    lua_setglobal(L, "sum");
+    luacpp11::push_callable(L, join);
+    lua_setglobal(L, "join");
+    luacpp11::push_callable(L, centroid_x);
+    lua_setglobal(L, "centroid_x");
+
+    luacpp11::emplace<Point>(L, 1.0, 2.0);
+    lua_setglobal(L, "a");
+    luacpp11::emplace<Point>(L, 3.0, 4.0);
+    lua_setglobal(L, "b");
+
+    int result = luaL_dostring(L,
+        "print(sum(), sum(1, 2, 3.5))\n"
+        "print(join(', ', 'a', 'b', 'c'))\n"
+        "print(centroid_x(a, b))\n"
+        // conversion errors name the argument
+        "print(pcall(sum, 1, 'x'))\n"
+        "print(pcall(join))\n"
+    );
+    if (result) {
+        std::cerr << "Error: " << lua_tostring(L, -1) << std::endl;
+    }
+
+    lua_close(L);
+
+    return 0;
+}
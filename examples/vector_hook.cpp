@@ -7,13 +7,14 @@
 
 #include "luacpp11.hpp"
 
+// __index is only called for keys that are not methods. The vector is passed
+// as const reference, so one function serves all variants.
 template<class T>
-luacpp11::luareturn vector_index_metamethod(lua_State *L)
+luacpp11::luareturn vector_index(const std::vector<T> &vec, lua_State *L)
 {
-    if(lua_isnumber(L, -1))
+    if(lua_isnumber(L, 2))
     {
-        int index = lua_tointeger(L, -1);
-        T &vec = luacpp11::tounchecked<T>(L, -2);
+        int index = lua_tointeger(L, 2);
         if(index<0 || index >= vec.size())
         {
             lua_pushfstring(L, "index out of bounds.");
@@ -23,251 +24,67 @@ luacpp11::luareturn vector_index_metamethod(lua_State *L)
     }
     else
     {
-        lua_getmetatable(L, -2);
-        lua_pushvalue(L, -2);
-        lua_rawget(L, -2);
-        lua_remove(L, -2);
+        lua_pushnil(L);
     }
     return 1;
 }
 
 template<class T>
-luacpp11::luareturn vector_newindex_metamethod(lua_State *L)
+void vector_newindex(std::vector<T> &vec, lua_State *L)
 {
-    if(lua_isnumber(L, -2))
+    if(lua_isnumber(L, 2))
     {
-        int index = lua_tointeger(L, -2);
-        T &vec = luacpp11::tounchecked<T>(L, -3);
+        int index = lua_tointeger(L, 2);
         if(index<0 || index >= vec.size())
         {
             lua_pushfstring(L, "index out of bounds.");
             lua_error(L);
         }
-        vec[index] = luacpp11::to<typename T::value_type>(L, -1);
+        vec[index] = luacpp11::to<T>(L, 3);
     }
     else
     {
         lua_pushfstring(L, "expected numerical index.");
         lua_error(L);
     }
-    return 0;
-}
-
-template<class T>
-luacpp11::luareturn vectorptr_index_metamethod(lua_State *L)
-{
-    if(lua_isnumber(L, -1))
-    {
-        int index = lua_tointeger(L, -1);
-        auto &vec = *luacpp11::tounchecked<T>(L, -2);
-        if(index<0 || index >= vec.size())
-        {
-            lua_pushfstring(L, "index out of bounds.");
-            lua_error(L);
-        }
-        luacpp11::push(L, vec[index]);
-    }
-    else
-    {
-        lua_getmetatable(L, -2);
-        lua_pushvalue(L, -2);
-        lua_rawget(L, -2);
-        lua_remove(L, -2);
-    }
-    return 1;
-}
-
-template<class T>
-luacpp11::luareturn vectorptr_newindex_metamethod(lua_State *L)
-{
-    if(lua_isnumber(L, -2))
-    {
-        int index = lua_tointeger(L, -2);
-        auto &vec = *luacpp11::tounchecked<T>(L, -3);
-        if(index<0 || index >= vec.size())
-        {
-            lua_pushfstring(L, "index out of bounds.");
-            lua_error(L);
-        }
-        vec[index] = luacpp11::to<decltype(vec[index])>(L, -1);
-    }
-    else
-    {
-        lua_pushfstring(L, "expected numerical index.");
-        lua_error(L);
-    }
-    return 0;
 }
 
 namespace luacpp11 {
+    // registers once for std::vector<T>, const std::vector<T>, pointers and
+    // shared_ptrs to them. The const variants get __len and __index only.
     template<class T>
-    struct register_hook< std::vector<T> > {
+    struct class_hook< std::vector<T> > {
         static void on_register(lua_State *L)
         {
-            lua_pushstring(L, "__len");
-            luacpp11::push_callable<size_t(std::vector<T>*, lua_State*)>(L,
-                [](std::vector<T> *v, lua_State*){ return v->size(); }
-            );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "__index");
-            luacpp11::push_callable(L, vector_index_metamethod< std::vector<T> >);
-            lua_rawset(L, -3);
-
-            lua_pushstring(L, "__newindex");
-            luacpp11::push_callable(L, vector_newindex_metamethod< std::vector<T> >);
-            lua_rawset(L, -3);
-
-            lua_pushstring(L, "clear");
-            luacpp11::push_callable(L, &std::vector<T>::clear);
-            lua_rawset(L, -3);
-        }
-    };
-    template<class T>
-    struct register_hook< const std::vector<T> > {
-        static void on_register(lua_State *L)
-        {
-            lua_pushstring(L, "__len");
-            luacpp11::push_callable<size_t(const std::vector<T>*, lua_State*)>(L,
+            // lua passes a second operand to __len
+            add_method<size_t(const std::vector<T>*, lua_State*)>(L, "__len",
                 [](const std::vector<T> *v, lua_State*){ return v->size(); }
             );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "__index");
-            luacpp11::push_callable(L, vector_index_metamethod< const std::vector<T> >);
-            lua_rawset(L, -3);
-        }
-    };
-    
-    template<class T>
-    struct register_hook< std::vector<T>* > {
-        static void on_register(lua_State *L)
-        {
-            lua_pushstring(L, "__len");
-            luacpp11::push_callable<size_t(std::vector<T>*, lua_State*)>(L,
-                [](std::vector<T> *v, lua_State*){ return v->size(); }
-            );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "__index");
-            luacpp11::push_callable(L, vectorptr_index_metamethod< std::vector<T>* >);
-            lua_rawset(L, -3);
+            add_method(L, "__index", vector_index<T>);
+            add_method(L, "__newindex", vector_newindex<T>);
 
-            lua_pushstring(L, "__newindex");
-            luacpp11::push_callable(L, vectorptr_newindex_metamethod< std::vector<T>* >);
-            lua_rawset(L, -3);
+            add_method(L, "clear", &std::vector<T>::clear);
 
-            lua_pushstring(L, "clear");
-            luacpp11::push_callable(L, &std::vector<T>::clear);
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "erase");
-            luacpp11::push_callable<void(std::vector<T>*, int)>(L, 
+            add_method<void(std::vector<T>*, int)>(L, "erase",
                 [](std::vector<T> *v, int index)
                 {
                     v->erase(v->begin()+index);
                 }
             );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "insert");
-            luacpp11::push_callable<void(std::vector<T>*, int, const T&)>(L, 
-                [](std::vector<T> *v, int index, const T& e)
-                {
-                    v->insert(v->begin()+index, e);
-                }
-            );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "push_back");
-            luacpp11::push_callable<void(std::vector<T>*, const T&)>(L, 
-                [](std::vector<T> *v, const T& e)
-                {
-                    v->push_back(e);
-                }
-            );
-            lua_rawset(L, -3);
-        }
-    };
-    template<class T>
-    struct register_hook< const std::vector<T>* > {
-        static void on_register(lua_State *L)
-        {
-            lua_pushstring(L, "__len");
-            luacpp11::push_callable<size_t(const std::vector<T>*, lua_State*)>(L,
-                [](const std::vector<T> *v, lua_State*){ return v->size(); }
-            );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "__index");
-            luacpp11::push_callable(L, vectorptr_index_metamethod< const std::vector<T>* >);
-            lua_rawset(L, -3);
-        }
-    };
-    
-    template<class T>
-    struct register_hook< std::shared_ptr< std::vector<T> > > {
-        static void on_register(lua_State *L)
-        {
-            lua_pushstring(L, "__len");
-            luacpp11::push_callable<size_t(std::vector<T>*, lua_State*)>(L,
-                [](std::vector<T> *v, lua_State*){ return v->size(); }
-            );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "__index");
-            luacpp11::push_callable(L, vectorptr_index_metamethod< std::shared_ptr< std::vector<T> > >);
-            lua_rawset(L, -3);
-
-            lua_pushstring(L, "__newindex");
-            luacpp11::push_callable(L, vectorptr_newindex_metamethod< std::shared_ptr< std::vector<T> > >);
-            lua_rawset(L, -3);
-
-            lua_pushstring(L, "clear");
-            luacpp11::push_callable(L, &std::vector<T>::clear);
-            lua_rawset(L, -3);
 
-            lua_pushstring(L, "erase");
-            luacpp11::push_callable<void(std::vector<T>*, int)>(L, 
-                [](std::vector<T> *v, int index)
-                {
-                    v->erase(v->begin()+index);
-                }
-            );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "insert");
-            luacpp11::push_callable<void(std::vector<T>*, int, const T&)>(L, 
+            add_method<void(std::vector<T>*, int, const T&)>(L, "insert",
                 [](std::vector<T> *v, int index, const T& e)
                 {
                     v->insert(v->begin()+index, e);
                 }
             );
-            lua_rawset(L, -3);
 
-            lua_pushstring(L, "push_back");
-            luacpp11::push_callable<void(std::vector<T>*, const T&)>(L, 
+            add_method<void(std::vector<T>*, const T&)>(L, "push_back",
                 [](std::vector<T> *v, const T& e)
                 {
                     v->push_back(e);
                 }
             );
-            lua_rawset(L, -3);
-        }
-    };
-    template<class T>
-    struct register_hook< std::shared_ptr< const std::vector<T> > > {
-        static void on_register(lua_State *L)
-        {
-            lua_pushstring(L, "__len");
-            luacpp11::push_callable<size_t(const std::vector<T>*, lua_State*)>(L,
-                [](const std::vector<T> *v, lua_State*){ return v->size(); }
-            );
-            lua_rawset(L, -3);
-            
-            lua_pushstring(L, "__index");
-            luacpp11::push_callable(L, vectorptr_index_metamethod< std::shared_ptr< const std::vector<T> > >);
-            lua_rawset(L, -3);
         }
     };
 }
@@ -2,18 +2,216 @@
 #define LUACPP11_H
 
 #include <functional>
+#include <algorithm>
 #include <type_traits>
 #include <tuple>
 #include <unordered_map>
 #include <string>
 #include <stdexcept>
 #include <memory>
+#include <cassert>
+#include <atomic>
+#include <climits>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LUACPP11_HAS_MAP_FILE
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace luacpp11 {
 
 namespace detail {
 template<class T, class Enable = void>
 struct StackHelper;
+
+// lua version compatibility layer. Everything that differs between 5.1,
+// 5.2, 5.3, 5.4 and LuaJIT goes through these functions so the rest of the
+// library can use the cheapest primitive available in each version.
+#if LUA_VERSION_NUM >= 502 || (defined(LUAJIT_VERSION_NUM) && LUAJIT_VERSION_NUM >= 20100)
+#define LUACPP11_HAS_TONUMBERX 1
+#endif
+
+inline void* newuserdata(lua_State *L, size_t size)
+{
+#if LUA_VERSION_NUM >= 504
+    return lua_newuserdatauv(L, size, 0);
+#else
+    return lua_newuserdata(L, size);
+#endif
+}
+
+// converts the value at index to a number, setting isnum to zero on failure
+inline lua_Number tonumberx(lua_State *L, int index, int *isnum)
+{
+#ifdef LUACPP11_HAS_TONUMBERX
+    return lua_tonumberx(L, index, isnum);
+#else
+    lua_Number value = lua_tonumber(L, index);
+    *isnum = value != 0 || lua_isnumber(L, index);
+    return value;
+#endif
+}
+
+// true if the float truncates to a lua_Integer without overflow, false for
+// NaN and infinities
+inline bool fits_integer(lua_Number value)
+{
+    const lua_Number min = static_cast<lua_Number>(std::numeric_limits<lua_Integer>::min());
+    return value >= min && value < -min;
+}
+
+// converts the value at index to an integer, setting isnum to zero on
+// failure. Floats with a fractional part are truncated like in lua 5.1,
+// floats out of the lua_Integer range are not convertible.
+inline lua_Integer tointegerx(lua_State *L, int index, int *isnum)
+{
+#if LUA_VERSION_NUM >= 503
+    lua_Integer value = lua_tointegerx(L, index, isnum);
+    if(*isnum)
+        return value;
+    lua_Number number = lua_tonumberx(L, index, isnum);
+    if(!*isnum || !fits_integer(number))
+    {
+        *isnum = 0;
+        return 0;
+    }
+    return static_cast<lua_Integer>(number);
+#elif defined(LUACPP11_HAS_TONUMBERX)
+    return lua_tointegerx(L, index, isnum);
+#else
+    lua_Integer value = lua_tointeger(L, index);
+    *isnum = value != 0 || lua_isnumber(L, index);
+    return value;
+#endif
+}
+
+// true if the value at index is a number without fractional part
+inline bool isinteger(lua_State *L, int index)
+{
+#if LUA_VERSION_NUM >= 503
+    return lua_isinteger(L, index);
+#else
+    if(lua_type(L, index) != LUA_TNUMBER)
+        return false;
+    lua_Number value = lua_tonumber(L, index);
+    return fits_integer(value) && value == static_cast<lua_Number>(static_cast<lua_Integer>(value));
+#endif
+}
+
+inline int absindex(lua_State *L, int index)
+{
+    if(index < 0 && index > LUA_REGISTRYINDEX)
+        return lua_gettop(L) + index + 1;
+    return index;
+}
+
+inline size_t rawlen(lua_State *L, int index)
+{
+#if LUA_VERSION_NUM >= 502
+    return lua_rawlen(L, index);
+#else
+    return lua_objlen(L, index);
+#endif
+}
+
+// pops a key and pushes t[key] where t is the table at index, returns the
+// type of the value
+inline int rawget(lua_State *L, int index)
+{
+#if LUA_VERSION_NUM >= 503
+    return lua_rawget(L, index);
+#else
+    lua_rawget(L, index);
+    return lua_type(L, -1);
+#endif
+}
+
+// pushes t[k] where t is the value at index, returns the type of the value
+inline int getfield(lua_State *L, int index, const char *k)
+{
+#if LUA_VERSION_NUM >= 503
+    return lua_getfield(L, index, k);
+#else
+    lua_getfield(L, index, k);
+    return lua_type(L, -1);
+#endif
+}
+
+// pushes t[n] where t is the table at index, returns the type of the value
+inline int rawgeti(lua_State *L, int index, int n)
+{
+#if LUA_VERSION_NUM >= 503
+    return lua_rawgeti(L, index, n);
+#else
+    lua_rawgeti(L, index, n);
+    return lua_type(L, -1);
+#endif
+}
+
+// pushes t[p] where t is the table at index and p is used as light userdata
+// key, returns the type of the value
+inline int rawgetp(lua_State *L, int index, const void *p)
+{
+#if LUA_VERSION_NUM >= 503
+    return lua_rawgetp(L, index, p);
+#elif LUA_VERSION_NUM == 502
+    lua_rawgetp(L, index, p);
+    return lua_type(L, -1);
+#else
+    if(index < 0 && index > LUA_REGISTRYINDEX)
+        --index;
+    lua_pushlightuserdata(L, const_cast<void*>(p));
+    lua_rawget(L, index);
+    return lua_type(L, -1);
+#endif
+}
+
+// lua_resume of all versions. nresults receives the number of values the
+// thread yielded or returned.
+inline int resume(lua_State *L, lua_State *from, int nargs, int *nresults)
+{
+#if LUA_VERSION_NUM >= 504
+    return lua_resume(L, from, nargs, nresults);
+#else
+#if LUA_VERSION_NUM >= 502
+    int status = lua_resume(L, from, nargs);
+#else
+    (void)from;
+    int status = lua_resume(L, nargs);
+#endif
+    *nresults = lua_gettop(L);
+    return status;
+#endif
+}
+
+// does t[p] = v where t is the table at index and v the value on top
+inline void rawsetp(lua_State *L, int index, const void *p)
+{
+#if LUA_VERSION_NUM >= 502
+    lua_rawsetp(L, index, p);
+#else
+    if(index < 0 && index > LUA_REGISTRYINDEX)
+        --index;
+    lua_pushlightuserdata(L, const_cast<void*>(p));
+    lua_insert(L, -2);
+    lua_rawset(L, index);
+#endif
+}
+
 }
 
 // return type for functions pushing their own return values
@@ -22,11 +220,149 @@ struct luareturn {
     int count;
 };
 
+// call policies for push_callable. checked validates argument count and
+// types, unchecked skips all validation and extracts arguments with
+// tounchecked semantics, debug_checked validates with assert only.
+struct checked { };
+struct unchecked { };
+struct debug_checked { };
+
 template<class T>
 struct register_hook {
     static void on_register(lua_State *L) { }
 };
 
+// describes how a userdata of type T refers to the object it holds. get
+// returns the object and rebind<B>::type is the same kind of storage for a
+// base class B of element_type. Specialize it to store objects in other
+// kinds of handles (for example intrusive reference counted pointers).
+template<class T>
+struct storage_traits {
+    typedef T element_type;
+    static element_type* get(T &storage) { return &storage; }
+    template<class B>
+    struct rebind {
+        typedef typename std::conditional<std::is_const<T>::value, const B, B>::type type;
+    };
+};
+
+template<class T>
+struct storage_traits<T*> {
+    typedef T element_type;
+    static element_type* get(T *storage) { return storage; }
+    template<class B>
+    struct rebind {
+        typedef typename storage_traits<T>::template rebind<B>::type* type;
+    };
+};
+
+template<class T>
+struct storage_traits< std::shared_ptr<T> > {
+    typedef T element_type;
+    static element_type* get(const std::shared_ptr<T> &storage) { return storage.get(); }
+    template<class B>
+    struct rebind {
+        typedef std::shared_ptr<typename storage_traits<T>::template rebind<B>::type> type;
+    };
+};
+
+template<class T>
+struct storage_traits< std::unique_ptr<T> > {
+    typedef T element_type;
+    static element_type* get(const std::unique_ptr<T> &storage) { return storage.get(); }
+    template<class B>
+    struct rebind {
+        typedef std::unique_ptr<typename storage_traits<T>::template rebind<B>::type> type;
+    };
+};
+
+// list of base classes used with the base_classes trait
+template<class... Bases>
+struct bases {
+    typedef bases type;
+};
+
+// specialize to declare the base classes of T. Objects of type T (held by
+// value, pointer or shared_ptr) are then accepted where a base is expected
+// and the metatables of T inherit from the ones of its bases.
+template<class T>
+struct base_classes : bases<> { };
+
+// specialize with a static on_register(lua_State *L) function to register
+// the methods of class T once per state (see add_method). The resulting
+// method tables are shared by the metatables of T, const T, T*, const T*,
+// std::shared_ptr<T> and std::shared_ptr<const T> where the const variants
+// only see the methods that can be called on const objects.
+template<class T>
+struct class_hook { };
+
+// specialize with a static size_t get(const T &object) that returns the
+// memory object owns outside of its userdata (e.g. the buffer of a vector).
+// Objects held by value or unique_ptr then report that memory to the
+// collector when they are pushed and are counted in memory_stats<T>.
+template<class T>
+struct memory_size { };
+
+// specialize with a static member template describe(S &s) that calls
+// s.field(name, member) or s.optional_field(name, member) for every field
+// to convert T from and to lua tables instead of userdata. describe is
+// instantiated for each conversion, so every field is converted directly
+// without runtime dispatch. Fields can be of any type luacpp11 converts,
+// other types with a table_schema and std::vector of those, which map to
+// arrays. Optional fields may be nil or missing and keep their value then.
+template<class T>
+struct table_schema { };
+
+// specialize as std::true_type for small trivially copyable types to let lua
+// pass a userdata of type T as extra last argument to bound functions
+// returning T by value. The result is then assigned to that userdata and
+// returned instead of allocating a new one, e.g. c = add(a, b, c).
+template<class T>
+struct result_destination : std::false_type { };
+
+// specialize as std::true_type to give the metatables of T, its pointers and
+// smart pointers the metamethods __add, __sub, __mul, __div, __unm, __eq,
+// __lt, __le and __call for the C++ operators T has. Arithmetic also works
+// with a number as one operand if T has the operator for double.
+template<class T>
+struct operator_metamethods : std::false_type { };
+
+// specialize as std::true_type for containers to give the metatables of T,
+// its pointers and smart pointers __pairs and (before lua 5.4) __ipairs
+// metamethods that iterate the container lazily like push_range. The
+// container must not be modified during the loop.
+template<class T>
+struct range_metamethods : std::false_type { };
+
+// destruction policies. By default objects are destroyed in __gc. Deferred
+// objects are moved into a queue of their lua state in __gc and destroyed by
+// destroy_deferred. Background objects are moved to a thread that destroys
+// them, so their destructors have to be safe to run on another thread.
+struct immediate_destruction { };
+struct deferred_destruction { };
+struct background_destruction { };
+
+// specialize with a type member naming one of the policies above to choose
+// how objects of type T held by value or smart pointer are destroyed
+template<class T>
+struct destruction_policy {
+    typedef immediate_destruction type;
+};
+
+// metrics of a destruction queue
+struct destruction_stats {
+    size_t pending;
+    size_t peak_pending;
+    size_t destroyed;
+    std::chrono::nanoseconds destroy_time;
+};
+
+// hits and misses of push_cached_callable
+struct cache_stats {
+    size_t hits;
+    size_t misses;
+};
+
 class ref {
 public:
     ref(const ref &that) : L(that.L)
@@ -62,6 +398,7 @@ public:
     }
 private:
     friend struct detail::StackHelper<ref>;
+    friend class weak_ref;
 
     ref(lua_State *L, int r) : L(L), r(r) { }
 
@@ -69,6 +406,391 @@ private:
     int r;
 };
 
+// a reference to a lua object that does not keep it alive. The object is
+// held in a weak table of the state and the weak_ref expires once it is
+// collected. Values that are not collectable (like numbers and strings) never
+// expire.
+class weak_ref {
+public:
+    weak_ref() : L(nullptr), id(0) { }
+    // refers to the value at index
+    weak_ref(lua_State *L, int index);
+    weak_ref(const weak_ref &that);
+    weak_ref(weak_ref &&that) : L(that.L), id(that.id)
+    {
+        that.id = 0;
+    }
+    weak_ref& operator=(weak_ref that)
+    {
+        std::swap(L, that.L);
+        std::swap(id, that.id);
+        return *this;
+    }
+    ~weak_ref();
+
+    bool expired() const;
+    // pushes the object or nil if it expired, returns false in that case
+    bool push(lua_State *L) const;
+    // a ref to the object, it refers to nil if the object expired
+    ref lock() const;
+private:
+    // moves the value on top of the stack into a new slot
+    void store();
+
+    lua_State *L;
+    int id;
+};
+
+// holds a lua value like ref, but nil, booleans, numbers, light userdata and
+// strings of up to inline_capacity bytes are stored inline instead of taking
+// a registry slot. Everything else is held through a registry reference.
+class value {
+public:
+    static const size_t inline_capacity = 16;
+
+    value() : data(), length(0), kind(nil_kind), ltype(LUA_TNIL) { }
+    value(const value &that) : data(that.data), length(that.length), kind(that.kind), ltype(that.ltype)
+    {
+        if(kind == reference_kind)
+        {
+            lua_rawgeti(data.reference.L, LUA_REGISTRYINDEX, data.reference.r);
+            data.reference.r = luaL_ref(data.reference.L, LUA_REGISTRYINDEX);
+        }
+    }
+    value(value &&that) : data(that.data), length(that.length), kind(that.kind), ltype(that.ltype)
+    {
+        that.kind = nil_kind;
+        that.ltype = LUA_TNIL;
+    }
+    value& operator=(value that)
+    {
+        std::swap(data, that.data);
+        std::swap(length, that.length);
+        std::swap(kind, that.kind);
+        std::swap(ltype, that.ltype);
+        return *this;
+    }
+    ~value()
+    {
+        if(kind == reference_kind)
+            luaL_unref(data.reference.L, LUA_REGISTRYINDEX, data.reference.r);
+    }
+
+    // the lua type of the value, e.g. LUA_TNUMBER
+    int type() const { return ltype; }
+    // true if the value does not use a registry reference
+    bool isinline() const { return kind != reference_kind; }
+
+    bool toboolean() const
+    {
+        return kind != nil_kind && (kind != boolean_kind || data.boolean);
+    }
+    lua_Number tonumber() const
+    {
+        return kind == number_kind ? data.number :
+               kind == integer_kind ? static_cast<lua_Number>(data.integer) : 0;
+    }
+    lua_Integer tointeger() const
+    {
+        return kind == integer_kind ? data.integer :
+               kind == number_kind ? static_cast<lua_Integer>(data.number) : 0;
+    }
+    // the string of string values, an empty string for other types
+    std::string tostring() const
+    {
+        if(kind == string_kind)
+            return std::string(data.chars, length);
+        std::string result;
+        if(ltype == LUA_TSTRING)
+        {
+            size_t size;
+            lua_rawgeti(data.reference.L, LUA_REGISTRYINDEX, data.reference.r);
+            const char *chars = lua_tolstring(data.reference.L, -1, &size);
+            result.assign(chars, size);
+            lua_pop(data.reference.L, 1);
+        }
+        return result;
+    }
+    void* touserdata() const
+    {
+        return kind == lightuserdata_kind ? data.pointer : nullptr;
+    }
+private:
+    friend struct detail::StackHelper<value>;
+
+    enum kinds : unsigned char {
+        nil_kind, boolean_kind, integer_kind, number_kind, string_kind,
+        lightuserdata_kind, reference_kind
+    };
+
+    union storage {
+        bool boolean;
+        lua_Integer integer;
+        lua_Number number;
+        void *pointer;
+        char chars[inline_capacity];
+        struct {
+            lua_State *L;
+            int r;
+        } reference;
+    } data;
+    unsigned char length;
+    unsigned char kind;
+    unsigned char ltype;
+};
+
+// a constant string that is interned once per lua state. Keys are meant to be
+// static objects and have to outlive the lua states they are pushed to.
+class key {
+public:
+    constexpr explicit key(const char *name) : name(name), index(0) { }
+    key(const key&) = delete;
+    key& operator=(const key&) = delete;
+
+    const char* c_str() const { return name; }
+    // pushes the key table of the lua state in which each key has a slot
+    static void push_table(lua_State *L);
+    // pushes the string with a lua_rawgeti of its slot in the key table at
+    // index table
+    void push(lua_State *L, int table) const;
+    // pushes the string with a registry lookup
+    void push(lua_State *L) const;
+private:
+    int slot() const;
+
+    const char *name;
+    mutable std::atomic<int> index;
+};
+
+// the remaining arguments of a call when used as the last parameter of a
+// bound function. Elements are converted like arguments of type T when they
+// are accessed.
+template<class T>
+class varargs {
+public:
+    typedef decltype(detail::StackHelper<T>::getarg(nullptr, 0)) reference;
+    typedef typename std::decay<reference>::type value_type;
+    typedef size_t size_type;
+
+    class iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef typename varargs::value_type value_type;
+        typedef typename varargs::reference reference;
+        typedef int difference_type;
+        typedef void pointer;
+
+        iterator() : L(nullptr), index(0) { }
+        iterator(lua_State *L, int index) : L(L), index(index) { }
+
+        reference operator*() const { return detail::StackHelper<T>::getarg(L, index); }
+        reference operator[](int n) const { return detail::StackHelper<T>::getarg(L, index+n); }
+
+        iterator& operator++() { ++index; return *this; }
+        iterator& operator--() { --index; return *this; }
+        iterator operator++(int) { iterator tmp(*this); ++index; return tmp; }
+        iterator operator--(int) { iterator tmp(*this); --index; return tmp; }
+        iterator& operator+=(int n) { index += n; return *this; }
+        iterator& operator-=(int n) { index -= n; return *this; }
+        iterator operator+(int n) const { return iterator(L, index+n); }
+        iterator operator-(int n) const { return iterator(L, index-n); }
+        int operator-(const iterator &that) const { return index - that.index; }
+
+        bool operator==(const iterator &that) const { return index == that.index; }
+        bool operator!=(const iterator &that) const { return index != that.index; }
+        bool operator<(const iterator &that) const { return index < that.index; }
+        bool operator>(const iterator &that) const { return index > that.index; }
+        bool operator<=(const iterator &that) const { return index <= that.index; }
+        bool operator>=(const iterator &that) const { return index >= that.index; }
+    private:
+        lua_State *L;
+        int index;
+    };
+
+    varargs(lua_State *L, int first)
+    : L(L), first(first), last(std::max(lua_gettop(L), first-1))
+    {
+    }
+
+    size_t size() const { return last - first + 1; }
+    bool empty() const { return last < first; }
+    reference operator[](size_t i) const { return detail::StackHelper<T>::getarg(L, index(i)); }
+    iterator begin() const { return iterator(L, first); }
+    iterator end() const { return iterator(L, last+1); }
+
+    // the stack index of element i
+    int index(size_t i) const { return first + static_cast<int>(i); }
+    lua_State* state() const { return L; }
+private:
+    lua_State *L;
+    int first;
+    int last;
+};
+
+enum class endian { little, big };
+
+// contiguous bytes for binary data. A buffer either owns its bytes, which are
+// then shared by all copies and slices of it, or borrows memory that the
+// caller keeps alive. Offsets are zero based.
+class buffer {
+public:
+    static const size_t npos = size_t(-1);
+
+    buffer() : bytes(nullptr), length(0) { }
+    // size zero bytes
+    explicit buffer(size_t size)
+    : storage(new char[size](), std::default_delete<char[]>()), bytes(storage.get()), length(size)
+    {
+    }
+    // a copy of size bytes at data
+    buffer(const void *data, size_t size)
+    : buffer(size)
+    {
+        if(size != 0)
+            std::memcpy(bytes, data, size);
+    }
+    // takes the bytes of the string over without copying them
+    explicit buffer(std::string &&string)
+    : length(string.size())
+    {
+        std::shared_ptr<std::string> owner = std::make_shared<std::string>(std::move(string));
+        bytes = &(*owner)[0];
+        storage = std::shared_ptr<char>(owner, bytes);
+    }
+    // size bytes at storage that are freed by storage
+    buffer(std::shared_ptr<char> storage, size_t size)
+    : storage(std::move(storage)), bytes(this->storage.get()), length(size)
+    {
+    }
+    // size bytes at data that are neither copied nor freed
+    static buffer borrow(void *data, size_t size)
+    {
+        return buffer(std::shared_ptr<char>(), static_cast<char*>(data), size);
+    }
+
+    char* data() { return bytes; }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+
+    // the size bytes at offset (or all after it) sharing the bytes of this
+    // buffer
+    buffer slice(size_t offset, size_t size = npos) const
+    {
+        if(offset > length)
+            throw std::out_of_range("buffer slice out of range");
+        size = std::min(size, length - offset);
+        return buffer(storage, bytes + offset, size);
+    }
+
+    // reads and writes arithmetic types in the given byte order
+    template<class T>
+    T read(size_t offset, endian order = endian::little) const
+    {
+        static_assert(std::is_arithmetic<T>::value, "buffer::read needs an arithmetic type");
+        check_range(offset, sizeof(T));
+        T result;
+        copy_ordered(&result, bytes + offset, sizeof(T), order);
+        return result;
+    }
+    template<class T>
+    void write(size_t offset, T value, endian order = endian::little)
+    {
+        static_assert(std::is_arithmetic<T>::value, "buffer::write needs an arithmetic type");
+        check_range(offset, sizeof(T));
+        copy_ordered(bytes + offset, &value, sizeof(T), order);
+    }
+    // copies size bytes at data to offset
+    void write_bytes(size_t offset, const void *data, size_t size)
+    {
+        check_range(offset, size);
+        if(size != 0)
+            std::memmove(bytes + offset, data, size);
+    }
+
+    // the offset of the first occurrence of the size bytes at needle at or
+    // after from, npos if there is none
+    size_t find(const void *needle, size_t size, size_t from = 0) const
+    {
+        if(from > length)
+            return npos;
+        const char *first = static_cast<const char*>(needle);
+        const char *found = std::search(bytes + from, bytes + length, first, first + size);
+        return found == bytes + length && size != 0 ? npos : found - bytes;
+    }
+    size_t find(const std::string &needle, size_t from = 0) const
+    {
+        return find(needle.data(), needle.size(), from);
+    }
+
+    std::string str() const { return std::string(bytes, length); }
+
+    // drops the reference of this buffer to its bytes and leaves it empty
+    void close()
+    {
+        storage.reset();
+        bytes = nullptr;
+        length = 0;
+    }
+
+    static endian native_order()
+    {
+        const uint16_t one = 1;
+        return *reinterpret_cast<const unsigned char*>(&one) == 1 ? endian::little : endian::big;
+    }
+private:
+    buffer(std::shared_ptr<char> storage, char *bytes, size_t length)
+    : storage(std::move(storage)), bytes(bytes), length(length)
+    {
+    }
+    void check_range(size_t offset, size_t size) const
+    {
+        if(offset > length || size > length - offset)
+            throw std::out_of_range("buffer access out of range");
+    }
+    static void copy_ordered(void *to, const void *from, size_t size, endian order)
+    {
+        std::memcpy(to, from, size);
+        if(order != native_order())
+            std::reverse(static_cast<char*>(to), static_cast<char*>(to) + size);
+    }
+
+    std::shared_ptr<char> storage;
+    char *bytes;
+    size_t length;
+};
+
+#ifdef LUACPP11_HAS_MAP_FILE
+// maps the file at path into memory. Writes to the buffer are private to the
+// process and never reach the file. The mapping is removed when the last
+// buffer referring to it is closed or destroyed.
+inline buffer map_file(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    struct stat info;
+    if(::fstat(fd, &info) != 0)
+    {
+        int error = errno;
+        ::close(fd);
+        throw std::runtime_error(path + ": " + std::strerror(error));
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    if(size == 0)
+    {
+        ::close(fd);
+        return buffer();
+    }
+    void *data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    ::close(fd);
+    if(data == MAP_FAILED)
+        throw std::runtime_error(path + ": " + std::strerror(error));
+    return buffer(std::shared_ptr<char>(static_cast<char*>(data), [size](char *bytes) { ::munmap(bytes, size); }), size);
+}
+#endif
+
 namespace detail {
 
 // sequence handling tools
@@ -78,22 +800,30 @@ struct type_seq { };
 template<int... I>
 struct int_seq { };
 
-template<int L, class seq>
-struct build_int_seq {};
-
-template<int L, int... S>
-struct build_int_seq<L, int_seq<S...> > {
-    typedef typename build_int_seq<L-1, int_seq<L-1, S...> >::value value;
-};
+template<class A, class B>
+struct concat_int_seq;
 
-template<int... S>
-struct build_int_seq<0, int_seq<S...> > {
-    typedef int_seq<S...> value;
+template<int... A, int... B>
+struct concat_int_seq<int_seq<A...>, int_seq<B...> > {
+    typedef int_seq<A..., (int(sizeof...(A)) + B)...> value;
 };
 
+// builds int_seq<0, ..., L-1> by halving, so the instantiation depth is
+// logarithmic in L
 template<int L>
 struct make_int_seq {
-    typedef typename build_int_seq<L, int_seq< > >::value value;
+    typedef typename concat_int_seq<typename make_int_seq<L/2>::value,
+                                    typename make_int_seq<L - L/2>::value>::value value;
+};
+
+template<>
+struct make_int_seq<0> {
+    typedef int_seq< > value;
+};
+
+template<>
+struct make_int_seq<1> {
+    typedef int_seq<0> value;
 };
 
 template<class seq, class T>
@@ -154,104 +884,456 @@ struct last< type_seq< > > {
 };
 
 
+// returns a unique key for the type T that is used as light userdata key
 template<class T>
-struct is_const_or_refers_to_const { static const bool value = false; };
-
-template<class T>
-struct is_const_or_refers_to_const<const T> { static const bool value = true; };
-template<class T>
-struct is_const_or_refers_to_const<const T*> { static const bool value = true; };
-template<class T>
-struct is_const_or_refers_to_const<const T&> { static const bool value = true; };
+const void* type_key()
+{
+    static const char key = 0;
+    return &key;
+}
 
-template<class T>
-struct remove_const_or_refers_to_const { typedef T type; };
+inline int next_key_slot()
+{
+    static std::atomic<int> slots(0);
+    return ++slots;
+}
 
-template<class T>
-struct remove_const_or_refers_to_const<const T> { typedef T type; };
-template<class T>
-struct remove_const_or_refers_to_const<const T*> { typedef T* type; };
-template<class T>
-struct remove_const_or_refers_to_const<const T&> { typedef T& type; };
+}
 
-template<class T>
-bool userdataIs(lua_State *L, int index)
+inline int key::slot() const
 {
-    if(lua_getmetatable(L, index) == 0)
-        return false;
-    StackHelper<T>::getmetatable(L);
-    bool equal = lua_rawequal(L, -1, -2);
-    lua_pop(L, 2);
-    return equal;
+    int result = index.load(std::memory_order_relaxed);
+    if(result == 0)
+    {
+        int expected = 0;
+        result = detail::next_key_slot();
+        if(!index.compare_exchange_strong(expected, result))
+            result = expected;
+    }
+    return result;
 }
 
-template<class T>
-T* getPointer(lua_State *L, int index)
+inline void key::push_table(lua_State *L)
 {
-    if(!lua_isuserdata(L, index))
-        return nullptr;
-
-    if(userdataIs<T*>(L, index))
+    if(detail::rawgetp(L, LUA_REGISTRYINDEX, detail::type_key<key>()) == LUA_TNIL)
     {
-        return *static_cast<T**>(lua_touserdata(L, index));
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        detail::rawsetp(L, LUA_REGISTRYINDEX, detail::type_key<key>());
     }
-    else if(userdataIs<T>(L, index))
+}
+
+inline void key::push(lua_State *L, int table) const
+{
+    int s = slot();
+    if(detail::rawgeti(L, table, s) == LUA_TNIL)
     {
-        return static_cast<T*>(lua_touserdata(L, index));
+        if(table < 0 && table > LUA_REGISTRYINDEX)
+            table += lua_gettop(L);
+        lua_pop(L, 1);
+        lua_pushstring(L, name);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, table, s);
     }
-    else if(userdataIs< std::shared_ptr<T> >(L, index))
-    {
-        return static_cast<std::shared_ptr<T>*>(lua_touserdata(L, index))->get();
+}
+
+inline void key::push(lua_State *L) const
+{
+    if(detail::rawgetp(L, LUA_REGISTRYINDEX, this) == LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        lua_pushstring(L, name);
+        lua_pushvalue(L, -1);
+        detail::rawsetp(L, LUA_REGISTRYINDEX, this);
     }
-    else if(is_const_or_refers_to_const<T>::value)
+}
+
+namespace detail {
+
+inline lua_State* parent_state(lua_State *L, lua_State *L2 = nullptr) {
+    static std::unordered_map<lua_State*, lua_State*> parent_map;
+    if(L2 == nullptr)
     {
-        return getPointer<typename remove_const_or_refers_to_const<T>::type>(L, index);
+        auto iter = parent_map.find(L);
+        if(iter == parent_map.end())
+            return L;
+        else
+            return iter->second;
     }
     else
     {
-        return nullptr;
+        return parent_map[L2] = parent_state(L);
     }
 }
 
-template<class T>
-bool canGetPointer(lua_State *L, int index)
+// the main thread of the state of L. Objects that outlive a call keep it
+// instead of the thread they were created from, which may be a coroutine
+// that is collected first. Lua 5.1 has no way to find the main thread from a
+// coroutine, so the first call records the main thread if it runs on it and
+// otherwise a new thread that the registry keeps alive as long as the state.
+inline lua_State* main_thread(lua_State *L)
 {
-    if(!lua_isuserdata(L, index))
-        return false;
+#if LUA_VERSION_NUM >= 502
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+    if(rawgetp(L, LUA_REGISTRYINDEX, type_key<lua_State>()) == LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        if(lua_pushthread(L) != 1)
+        {
+            lua_pop(L, 1);
+            lua_newthread(L);
+        }
+        lua_pushvalue(L, -1);
+        rawsetp(L, LUA_REGISTRYINDEX, type_key<lua_State>());
+    }
+#endif
+    lua_State *main = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    return main;
+}
 
-    if(userdataIs<T*>(L, index))
+// the weak valued table holding the objects of weak_refs. Like with luaL_ref
+// released slots form a list starting at index 0, but new slots are counted
+// at index -1 since collected objects leave holes in slots that are still
+// in use.
+inline void push_weak_table(lua_State *L)
+{
+    if(rawgetp(L, LUA_REGISTRYINDEX, type_key<weak_ref>()) == LUA_TNIL)
     {
-        return true;
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushinteger(L, 0);
+        lua_rawseti(L, -2, 0);
+        lua_pushinteger(L, 0);
+        lua_rawseti(L, -2, -1);
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, "__mode");
+        lua_pushstring(L, "v");
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        rawsetp(L, LUA_REGISTRYINDEX, type_key<weak_ref>());
     }
-    else if(userdataIs<T>(L, index))
+}
+
+}
+
+// the slot is filled on the stack of L, but the weak_ref keeps the main
+// thread since L may be a coroutine that is collected first
+inline weak_ref::weak_ref(lua_State *L, int index) : L(L), id(0)
+{
+    lua_pushvalue(L, index);
+    store();
+    this->L = detail::main_thread(L);
+}
+
+inline weak_ref::weak_ref(const weak_ref &that) : L(that.L), id(0)
+{
+    if(that.id != 0)
     {
-        return true;
+        that.push(L);
+        store();
     }
-    else if(userdataIs< std::shared_ptr<T> >(L, index))
+}
+
+inline weak_ref::~weak_ref()
+{
+    if(id == 0)
+        return;
+    detail::push_weak_table(L);
+    detail::rawgeti(L, -1, 0);
+    lua_rawseti(L, -2, id);
+    lua_pushinteger(L, id);
+    lua_rawseti(L, -2, 0);
+    lua_pop(L, 1);
+}
+
+inline void weak_ref::store()
+{
+    if(lua_isnil(L, -1))
     {
-        return true;
+        lua_pop(L, 1);
+        return;
     }
-    else if(is_const_or_refers_to_const<T>::value)
+    detail::push_weak_table(L);
+    detail::rawgeti(L, -1, 0);
+    id = static_cast<int>(lua_tointeger(L, -1));
+    lua_pop(L, 1);
+    if(id != 0)
     {
-        return canGetPointer<typename remove_const_or_refers_to_const<T>::type>(L, index);
+        detail::rawgeti(L, -1, id);
+        lua_rawseti(L, -2, 0);
     }
     else
     {
+        detail::rawgeti(L, -1, -1);
+        id = static_cast<int>(lua_tointeger(L, -1)) + 1;
+        lua_pop(L, 1);
+        lua_pushinteger(L, id);
+        lua_rawseti(L, -2, -1);
+    }
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+}
+
+inline bool weak_ref::expired() const
+{
+    if(id == 0)
+        return true;
+    detail::push_weak_table(L);
+    bool result = detail::rawgeti(L, -1, id) == LUA_TNIL;
+    lua_pop(L, 2);
+    return result;
+}
+
+inline bool weak_ref::push(lua_State *L) const
+{
+    if(id == 0)
+    {
+        lua_pushnil(L);
         return false;
     }
+    detail::push_weak_table(L);
+    bool result = detail::rawgeti(L, -1, id) != LUA_TNIL;
+    lua_remove(L, -2);
+    return result;
+}
+
+inline ref weak_ref::lock() const
+{
+    if(!push(L))
+    {
+        lua_pop(L, 1);
+        return ref(L, LUA_REFNIL);
+    }
+    return ref(L, luaL_ref(L, LUA_REGISTRYINDEX));
+}
+
+namespace detail {
+
+// metatables of userdata types map the type_key of every type their objects
+// can be converted to onto a cast_entry. The get function returns the
+// (adjusted) object pointer for a given userdata block, share is only set for
+// shared_ptr storage and returns a shared_ptr aliasing the same object.
+struct cast_entry {
+    void* (*get)(void *userdata);
+    std::shared_ptr<void> (*share)(void *userdata);
+};
+
+// the alignment lua guarantees for userdata memory
+union userdata_align {
+    lua_Number n;
+    double d;
+    void *p;
+    lua_Integer i;
+    long l;
+};
+
+// storage with a larger alignment than lua guarantees is placed at the next
+// suitably aligned address of a userdata that is allocated larger by the
+// difference. All access to the storage of a userdata goes through here.
+template<class V, size_t Align = alignof(V), bool = (Align > alignof(userdata_align))>
+struct UserdataLayout {
+    static const size_t padding = 0;
+    static V* storage(void *userdata)
+    {
+        return static_cast<V*>(userdata);
+    }
+};
+
+template<class V, size_t Align>
+struct UserdataLayout<V, Align, true> {
+    static const size_t padding = Align - alignof(userdata_align);
+    static V* storage(void *userdata)
+    {
+        uintptr_t address = reinterpret_cast<uintptr_t>(userdata);
+        return reinterpret_cast<V*>((address + Align - 1) & ~static_cast<uintptr_t>(Align - 1));
+    }
+};
+
+// returns the storage V of a userdata block
+template<class V>
+V* userdata_storage(void *userdata)
+{
+    return UserdataLayout<V>::storage(userdata);
+}
+
+// pushes a new userdata with size bytes for storage V and returns the
+// address of the storage
+template<class V>
+void* newuserdata_storage(lua_State *L, size_t size)
+{
+    typedef UserdataLayout<typename std::remove_cv<V>::type> layout;
+    return layout::storage(newuserdata(L, size + layout::padding));
+}
+
+template<class V, class X>
+void* cast_userdata(void *userdata)
+{
+    X *ptr = storage_traits<V>::get(*userdata_storage<V>(userdata));
+    return const_cast<void*>(static_cast<const void*>(ptr));
+}
+
+template<class V, class X>
+struct ShareHelper {
+    static std::shared_ptr<void> (*function())(void*)
+    {
+        return nullptr;
+    }
+};
+
+template<class U, class X>
+struct ShareHelper<std::shared_ptr<U>, X> {
+    static std::shared_ptr<void> share(void *userdata)
+    {
+        std::shared_ptr<U> &storage = *userdata_storage< std::shared_ptr<U> >(userdata);
+        X *ptr = storage.get();
+        return std::shared_ptr<void>(storage, const_cast<void*>(static_cast<const void*>(ptr)));
+    }
+    static std::shared_ptr<void> (*function())(void*)
+    {
+        return share;
+    }
+};
+
+template<class V, class X>
+const cast_entry* get_cast_entry()
+{
+    static const cast_entry entry = { cast_userdata<V, X>, ShareHelper<V, X>::function() };
+    return &entry;
+}
+
+template<class V, class X>
+void set_cast_entry(lua_State *L)
+{
+    lua_pushlightuserdata(L, const_cast<cast_entry*>(get_cast_entry<V, X>()));
+    rawsetp(L, -2, type_key<X>());
+}
+
+template<class V>
+void* storage_userdata(void *userdata)
+{
+    return const_cast<typename std::remove_const<V>::type*>(userdata_storage<V>(userdata));
+}
+
+// the entry for the storage type V itself returns the handle stored in the
+// userdata, so handles can be passed back to C++
+template<class V>
+void set_storage_entry(lua_State *L)
+{
+    static const cast_entry entry = { storage_userdata<V>, nullptr };
+    lua_pushlightuserdata(L, const_cast<cast_entry*>(&entry));
+    rawsetp(L, -2, type_key<V>());
+}
+
+// adds the cast entries for X and all its bases to the metatable of V on top
+// of the stack. Const objects only get entries for the const types.
+template<class V, class X, bool = std::is_const<typename storage_traits<V>::element_type>::value>
+struct CastTable {
+    static void add(lua_State *L)
+    {
+        set_cast_entry<V, X>(L);
+        set_cast_entry<V, const X>(L);
+        add_bases(L, typename base_classes<X>::type());
+    }
+    template<class... B>
+    static void add_bases(lua_State *L, bases<B...>)
+    {
+        int expand[] = {0, (CastTable<V, B>::add(L), 0)...};
+        (void)expand;
+    }
+};
+
+template<class V, class X>
+struct CastTable<V, X, true> {
+    static void add(lua_State *L)
+    {
+        set_cast_entry<V, const X>(L);
+        add_bases(L, typename base_classes<X>::type());
+    }
+    template<class... B>
+    static void add_bases(lua_State *L, bases<B...>)
+    {
+        int expand[] = {0, (CastTable<V, B>::add(L), 0)...};
+        (void)expand;
+    }
+};
+
+// looks up the cast entry for the type with the given key in the metatable
+// of the userdata at index
+inline const cast_entry* findCastEntry(lua_State *L, int index, const void *key)
+{
+    if(lua_type(L, index) != LUA_TUSERDATA || lua_getmetatable(L, index) == 0)
+        return nullptr;
+    rawgetp(L, -1, key);
+    const cast_entry *entry = static_cast<const cast_entry*>(lua_touserdata(L, -1));
+    lua_pop(L, 2);
+    return entry;
+}
+
+template<class T>
+const cast_entry* findCastEntry(lua_State *L, int index)
+{
+    return findCastEntry(L, index, type_key<T>());
+}
+
+template<class T>
+bool userdataIs(lua_State *L, int index)
+{
+    if(lua_getmetatable(L, index) == 0)
+        return false;
+    StackHelper<T>::getmetatable(L);
+    bool equal = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return equal;
+}
+
+template<class T>
+T* getPointer(lua_State *L, int index)
+{
+    const cast_entry *entry = findCastEntry<T>(L, index);
+    if(entry == nullptr)
+        return nullptr;
+    return static_cast<T*>(entry->get(lua_touserdata(L, index)));
+}
+
+template<class T>
+bool canGetPointer(lua_State *L, int index)
+{
+    return findCastEntry<T>(L, index) != nullptr;
+}
+
+// type returned when extracting a T from the stack
+template<class T>
+struct get_result { typedef T& type; };
+
+template<class T>
+struct get_result<T*> { typedef T* type; };
+
+template<class T>
+struct get_result< std::shared_ptr<T> > { typedef std::shared_ptr<T> type; };
+
+template<class T>
+struct get_result< const std::shared_ptr<T> > { typedef std::shared_ptr<T> type; };
+
+// raises the error for an argument of the wrong type. All argument
+// conversions share it instead of formatting the message themselves.
+inline int argument_error(lua_State *L, int index, const char *expected)
+{
+    lua_pushfstring(L, "expected %s in argument %d", expected, index);
+    return lua_error(L);
 }
 
 template<class T>
 struct GetHelper {
-    template<int Index>
-    static T& get(lua_State *L)
+    static T& getarg(lua_State *L, int index)
     {
-        T *ptr = getPointer<T>(L, Index);
+        T *ptr = getPointer<T>(L, index);
         if(ptr == nullptr)
-        {
-            lua_pushfstring(L, "expected userdata in argument %d", Index);
-            lua_error(L);
-        }
+            argument_error(L, index, "userdata");
         return *ptr;
     }
     static T& get(lua_State *L, int index)
@@ -263,21 +1345,21 @@ struct GetHelper {
         }
         return *ptr;
     }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return canGetPointer<T>(L, index);
+    }
 };
 
 template<class U>
 struct GetHelper<U*> {
     typedef U* T;
-    template<int Index>
-    static T get(lua_State *L)
+    static T getarg(lua_State *L, int index)
     {
-        if(lua_isnil(L, Index)) return nullptr;
-        T ptr = getPointer<U>(L, Index);
+        if(lua_isnil(L, index)) return nullptr;
+        T ptr = getPointer<U>(L, index);
         if(ptr == nullptr)
-        {
-            lua_pushfstring(L, "expected userdata in argument %d", Index);
-            lua_error(L);
-        }
+            argument_error(L, index, "userdata");
         return ptr;
     }
     static T get(lua_State *L, int index)
@@ -290,352 +1372,1436 @@ struct GetHelper<U*> {
         }
         return ptr;
     }
-};
-
-inline lua_State* parent_state(lua_State *L, lua_State *L2 = nullptr) {
-    static std::unordered_map<lua_State*, lua_State*> parent_map;
-    if(L2 == nullptr)
-    {
-        auto iter = parent_map.find(L);
-        if(iter == parent_map.end())
-            return L;
-        else
-            return iter->second;
-    }
-    else
-    {
-        return parent_map[L2] = parent_state(L);
-    }
-}
-
-template<class T, class Enable>
-struct StackHelper {
-    template<int Index>
-    static typename std::conditional< std::is_pointer<T>::value, T, T&>::type get(lua_State *L)
-    {
-        return GetHelper<T>::template get<Index>(L);
-    }
-    static typename std::conditional< std::is_pointer<T>::value, T, T&>::type get(lua_State *L, int index)
-    {
-        return GetHelper<T>::get(L, index);
-    }
     static bool isconvertible(lua_State *L, int index)
     {
-        return canGetPointer<typename std::remove_pointer<T>::type>(L, index);
-    }
-    static typename std::conditional< std::is_pointer<T>::value, T, T&>::type getexact(lua_State *L, int index)
-    {
-        if(!is(L, index))
-            throw std::runtime_error("type mismatch");
-        return *static_cast<T*>(lua_touserdata(L, index));
-    }
-    static typename std::conditional< std::is_pointer<T>::value, T, T&>::type getunchecked(lua_State *L, int index)
-    {
-        return *static_cast<T*>(lua_touserdata(L, index));
-    }
-    static bool is(lua_State *L, int index)
-    {
-        if(!lua_isuserdata(L, index))
-            return false;
-        return userdataIs<T>(L, index);
-    }
-    static void push(lua_State *L, const T& value)
-    {
-        new (lua_newuserdata(L, sizeof(T))) T(value);
-        getmetatable(L);
-        lua_setmetatable(L, -2);
+        return canGetPointer<U>(L, index);
     }
-    static void push(lua_State *L, T&& value)
+};
+
+// shared_ptr are returned by value so objects held by a shared_ptr to a
+// derived type can be converted
+template<class U>
+struct GetHelper< std::shared_ptr<U> > {
+    typedef std::shared_ptr<U> T;
+    static bool tryGet(lua_State *L, int index, T &result)
     {
-        new (lua_newuserdata(L, sizeof(T))) T(std::move(value));
-        getmetatable(L);
-        lua_setmetatable(L, -2);
+        const cast_entry *entry = findCastEntry<U>(L, index);
+        if(entry != nullptr && entry->share != nullptr)
+        {
+            std::shared_ptr<void> ptr = entry->share(lua_touserdata(L, index));
+            result = T(ptr, static_cast<U*>(ptr.get()));
+            return true;
+        }
+        T *ptr = getPointer<T>(L, index);
+        if(ptr != nullptr)
+        {
+            result = *ptr;
+            return true;
+        }
+        return false;
     }
-    template<class... Args>
-    static void emplace(lua_State *L, Args&&... args)
+    static T getarg(lua_State *L, int index)
     {
-        new (lua_newuserdata(L, sizeof(T))) T(std::forward<Args>(args)...);
-        getmetatable(L);
-        lua_setmetatable(L, -2);
+        T result;
+        if(!tryGet(L, index, result))
+            argument_error(L, index, "userdata");
+        return result;
     }
-    static void getmetatable(lua_State *L)
+    static T get(lua_State *L, int index)
     {
-        typedef typename std::unordered_map<lua_State*, int>::value_type map_entry_t;
-        static std::unordered_map<lua_State*, int> index_table;
-        auto iter = index_table.find(parent_state(L));
-        if(iter == index_table.end())
+        T result;
+        if(!tryGet(L, index, result))
         {
-            lua_newtable(L);
-            lua_pushstring(L, "__gc");
-            lua_pushcfunction(L, destroy_T);
-            lua_rawset(L, -3);
-            iter = index_table.insert(map_entry_t(L, luaL_ref(L, LUA_REGISTRYINDEX))).first;
-
-            lua_rawgeti(L, LUA_REGISTRYINDEX, iter->second);
-            register_hook<T>::on_register(L);
-            return;
+            throw std::runtime_error("type mismatch");
         }
-        lua_rawgeti(L, LUA_REGISTRYINDEX, iter->second);
+        return result;
     }
-private:
-    static int destroy_T(lua_State *L)
+    static bool isconvertible(lua_State *L, int index)
     {
-        T *userdata = static_cast <T*> (lua_touserdata (L, -1));
-        userdata->~T();
-        return 0;
+        const cast_entry *entry = findCastEntry<U>(L, index);
+        return (entry != nullptr && entry->share != nullptr) || canGetPointer<T>(L, index);
     }
 };
 
-template<class T>
-struct StackHelper<T, typename std::enable_if<std::is_lvalue_reference<T>::value>::type>
-    : public StackHelper<typename  std::remove_reference<T>::type >
-{
+template<class U>
+struct GetHelper< const std::shared_ptr<U> > : public GetHelper< std::shared_ptr<U> > {
 };
 
+// maps the storage type T of a derived class onto the same kind of
+// storage for its base class B
+template<class T, class B>
+struct rebind_storage {
+    typedef typename storage_traits<T>::template rebind<B>::type type;
+};
 
-template<class T>
-struct StackHelper<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<typename std::remove_cv<T>::type, bool>::value >::type> {
-    template<int Index>
-    static T get(lua_State *L)
+// copies the metamethods of the table at index from that are not present in
+// the table at index to
+inline void copy_metamethods(lua_State *L, int from, int to)
+{
+    from = absindex(L, from);
+    to = absindex(L, to);
+    lua_pushnil(L);
+    while(lua_next(L, from) != 0)
     {
-        if(!lua_isnumber(L, Index))
+        if(lua_type(L, -2) == LUA_TSTRING)
         {
-            lua_pushfstring(L, "expected number in argument %d", Index);
-            lua_error(L);
+            std::string key = lua_tostring(L, -2);
+            if(key.compare(0, 2, "__") == 0 && key != "__gc")
+            {
+                lua_pushvalue(L, -2);
+                lua_rawget(L, to);
+                bool missing = lua_isnil(L, -1);
+                lua_pop(L, 1);
+                if(missing)
+                {
+                    lua_pushvalue(L, -2);
+                    lua_pushvalue(L, -2);
+                    lua_rawset(L, to);
+                }
+            }
         }
-        return lua_tointeger(L, Index);
+        lua_pop(L, 1);
     }
-    static bool is(lua_State *L, int index)
+}
+
+// __index of metatables with multiple bases, searches the base metatables
+// stored as upvalues in order
+inline int index_bases(lua_State *L)
+{
+    for(int i = 1; lua_type(L, lua_upvalueindex(i)) != LUA_TNONE; ++i)
     {
-        return lua_isnumber(L, index);
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(i));
+        if(!lua_isnil(L, -1))
+            return 1;
+        lua_pop(L, 1);
     }
-    static bool isconvertible(lua_State *L, int index)
+    return 0;
+}
+
+template<class T>
+struct has_class_hook {
+    template<class U>
+    static char test(decltype(&class_hook<U>::on_register));
+    template<class U>
+    static long test(...);
+    static const bool value = sizeof(test<T>(0)) == 1;
+};
+
+template<class Bases>
+struct any_has_class_table;
+
+// classes get a class table if they or any of their bases have a class_hook
+template<class T>
+struct has_class_table {
+    static const bool value = has_class_hook<T>::value || any_has_class_table<typename base_classes<T>::type>::value;
+};
+
+template<>
+struct any_has_class_table< bases<> > {
+    static const bool value = false;
+};
+
+template<class B, class... Rest>
+struct any_has_class_table< bases<B, Rest...> > {
+    static const bool value = has_class_table<B>::value || any_has_class_table< bases<Rest...> >::value;
+};
+
+template<class T, bool = has_class_hook<T>::value>
+struct ClassHookHelper {
+    static void on_register(lua_State *L)
     {
-        return is(L, index);
+        class_hook<T>::on_register(L);
     }
-    static T get(lua_State *L, int index)
+};
+
+template<class T>
+struct ClassHookHelper<T, false> {
+    static void on_register(lua_State*)
     {
-        return getexact(L, index);
     }
-    static T getexact(lua_State *L, int index)
+};
+
+// the class table of T holds the table with all methods at index 1, the
+// table with the const methods at index 2 and the field table at index 3.
+// They inherit from the corresponding tables of the bases of T. Index 4 is
+// true if T or one of its bases has fields. Indices 5 and 6 hold the
+// metamethods of the non const and const variants, including the ones of
+// the bases that T doesn't override.
+template<class T>
+struct ClassTable {
+    static void push(lua_State *L)
     {
-        if(!is(L, index))
-            throw std::runtime_error("type mismatch");
-        return getunchecked(L, index);
+        rawgetp(L, LUA_REGISTRYINDEX, type_key<ClassTable>());
+        if(lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_createtable(L, 6, 0);
+            for(int slot = 1; slot <= 6; ++slot)
+            {
+                if(slot == 4)
+                    continue;
+                lua_newtable(L);
+                lua_rawseti(L, -2, slot);
+            }
+            lua_pushvalue(L, -1);
+            rawsetp(L, LUA_REGISTRYINDEX, type_key<ClassTable>());
+
+            ClassHookHelper<T>::on_register(L);
+            link(L, typename base_classes<T>::type());
+        }
     }
-    static T getunchecked(lua_State *L, int index)
+private:
+    template<class... B>
+    static void link(lua_State *L, bases<B...>)
+    {
+        int count = 0;
+        int expand[] = {0, (count += push_base<B>(L), 0)...};
+        (void)expand;
+        if(count == 0)
+            return;
+        for(int i = 0; i < count; ++i)
+        {
+            lua_rawgeti(L, -count+i, 4);
+            if(lua_toboolean(L, -1))
+            {
+                lua_pushboolean(L, 1);
+                lua_rawseti(L, -count-3, 4);
+            }
+            lua_pop(L, 1);
+        }
+        for(int slot = 5; slot <= 6; ++slot)
+        {
+            lua_rawgeti(L, -count-1, slot);
+            for(int i = 0; i < count; ++i)
+            {
+                lua_rawgeti(L, -count-1+i, slot);
+                copy_metamethods(L, -1, -2);
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+        for(int slot = 1; slot <= 3; ++slot)
+        {
+            lua_rawgeti(L, -count-1, slot);
+            lua_createtable(L, 0, 1);
+            lua_pushliteral(L, "__index");
+            for(int i = 0; i < count; ++i)
+                lua_rawgeti(L, -count-3, slot);
+            if(count > 1)
+                lua_pushcclosure(L, index_bases, count);
+            lua_rawset(L, -3);
+            lua_setmetatable(L, -2);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, count);
+    }
+    template<class B>
+    static int push_base(lua_State *L)
     {
-        return lua_tointeger(L, index);
+        if(!has_class_table<B>::value)
+            return 0;
+        ClassTable<B>::push(L);
+        return 1;
     }
-    static void push(lua_State *L, T value)
+};
+
+// sets the __index of the metatable on top of the stack to the method
+// table of the class of T if it has one
+template<class T, bool = has_class_table<typename std::remove_const<typename storage_traits<T>::element_type>::type>::value>
+struct ClassIndex {
+    static void add(lua_State*)
     {
-        lua_pushinteger(L, value);
     }
 };
 
-template<class T>
-struct StackHelper<T, typename std::enable_if<std::is_same<typename std::remove_cv<T>::type, bool>::value >::type> {
-    template<int Index>
-    static T get(lua_State *L)
+// fields are described by a field_descriptor in the field table of a
+// class. get pushes the value of the field of the object, set assigns the
+// value at index to it and is null for read-only fields.
+struct field_descriptor {
+    const void *owner;
+    const void *const_owner;
+    void (*get)(lua_State *L, void *object, const field_descriptor *field);
+    void (*set)(lua_State *L, void *object, int index, const field_descriptor *field);
+};
+
+template<class C, class M>
+struct member_field : field_descriptor {
+    M C::*member;
+
+    static void get_member(lua_State *L, void *object, const field_descriptor *field)
+    {
+        const member_field *self = static_cast<const member_field*>(field);
+        StackHelper<M>::push(L, static_cast<C*>(object)->*(self->member));
+    }
+    static void set_member(lua_State *L, void *object, int index, const field_descriptor *field)
     {
-        if(!lua_isboolean(L, Index))
+        const member_field *self = static_cast<const member_field*>(field);
+        if(!StackHelper<M>::isconvertible(L, index))
         {
-            lua_pushfstring(L, "expected boolean in argument %d", Index);
+            lua_pushstring(L, "invalid value for field");
             lua_error(L);
         }
-        return lua_toboolean(L, Index);
+        static_cast<C*>(object)->*(self->member) = StackHelper<M>::get(L, index);
     }
-    static bool is(lua_State *L, int index)
+};
+
+// const data members never get a setter
+template<class C, class M, bool Const = std::is_const<M>::value>
+struct field_setter {
+    static decltype(field_descriptor::set) get() { return member_field<C, M>::set_member; }
+};
+
+template<class C, class M>
+struct field_setter<C, M, true> {
+    static decltype(field_descriptor::set) get() { return nullptr; }
+};
+
+// returns the object of the userdata at index 1 as pointer to the class
+// owning field
+template<class T>
+void* field_object(lua_State *L, const field_descriptor *field)
+{
+    typedef typename storage_traits<T>::element_type element_type;
+    void *object = const_cast<void*>(static_cast<const void*>(storage_traits<T>::get(*userdata_storage<T>(lua_touserdata(L, 1)))));
+    if(object == nullptr)
     {
-        return lua_isboolean(L, index);
+        lua_pushstring(L, "attempt to access a field of a null object");
+        lua_error(L);
     }
-    static bool isconvertible(lua_State *L, int index)
+    const void *owner = std::is_const<element_type>::value ? field->const_owner : field->owner;
+    if(owner == type_key<element_type>())
+        return object;
+    return findCastEntry(L, 1, owner)->get(lua_touserdata(L, 1));
+}
+
+// __index for classes with fields, upvalue 1 is the field table and
+// upvalue 2 the method table
+template<class T>
+int field_index(lua_State *L)
+{
+    lua_pushvalue(L, 2);
+    lua_gettable(L, lua_upvalueindex(1));
+    if(lua_type(L, -1) == LUA_TUSERDATA)
     {
-        return is(L, index);
+        const field_descriptor *field = static_cast<const field_descriptor*>(lua_touserdata(L, -1));
+        field->get(L, field_object<T>(L, field), field);
+        return 1;
     }
-    static T get(lua_State *L, int index)
+    lua_pop(L, 1);
+    lua_gettable(L, lua_upvalueindex(2));
+    return 1;
+}
+
+// __newindex for classes with fields, upvalue 1 is the field table
+template<class T>
+int field_newindex(lua_State *L)
+{
+    lua_pushvalue(L, 2);
+    lua_gettable(L, lua_upvalueindex(1));
+    const field_descriptor *field = static_cast<const field_descriptor*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    const char *name = lua_isstring(L, 2) ? lua_tostring(L, 2) : "?";
+    if(field == nullptr)
     {
-        return getexact(L, index);
+        lua_pushfstring(L, "no field '%s'", name);
+        lua_error(L);
     }
-    static T getexact(lua_State *L, int index)
+    if(field->set == nullptr || std::is_const<typename storage_traits<T>::element_type>::value)
     {
-        if(!is(L, index))
-            throw std::runtime_error("type mismatch");
-        return getunchecked(L, index);
+        lua_pushfstring(L, "field '%s' is read-only", name);
+        lua_error(L);
     }
-    static T getunchecked(lua_State *L, int index)
+    field->set(L, field_object<T>(L, field), 3, field);
+    return 0;
+}
+
+// __index for classes with an __index metamethod. Upvalue 1 is the method
+// table or the field_index closure, which are tried first, and upvalue 2 the
+// metamethod that is called for all other keys.
+inline int class_index(lua_State *L)
+{
+    lua_settop(L, 2);
+    if(lua_istable(L, lua_upvalueindex(1)))
     {
-        return lua_toboolean(L, index);
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(1));
     }
-    static void push(lua_State *L, T value)
+    else
     {
-        lua_pushboolean(L, value);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_call(L, 2, 1);
     }
-};
+    if(!lua_isnil(L, -1))
+        return 1;
+    lua_pop(L, 1);
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_insert(L, 1);
+    lua_call(L, 2, 1);
+    return 1;
+}
 
 template<class T>
-struct StackHelper<T, typename std::enable_if<std::is_floating_point<T>::value >::type> {
-    template<int Index>
-    static T get(lua_State *L)
+struct ClassIndex<T, true> {
+    typedef typename storage_traits<T>::element_type element_type;
+    static void add(lua_State *L)
     {
-        if(!lua_isnumber(L, Index))
+        ClassTable<typename std::remove_const<element_type>::type>::push(L);
+        lua_rawgeti(L, -1, 4);
+        bool has_fields = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_pushliteral(L, "__index");
+        if(has_fields)
         {
-            lua_pushfstring(L, "expected number in argument %d", Index);
-            lua_error(L);
+            lua_rawgeti(L, -2, 3);
+            lua_rawgeti(L, -3, std::is_const<element_type>::value ? 2 : 1);
+            lua_pushcclosure(L, field_index<T>, 2);
+            lua_rawset(L, -4);
+            lua_pushliteral(L, "__newindex");
+            lua_rawgeti(L, -2, 3);
+            lua_pushcclosure(L, field_newindex<T>, 1);
+        }
+        else
+        {
+            lua_rawgeti(L, -2, std::is_const<element_type>::value ? 2 : 1);
         }
-        return lua_tonumber(L, Index);
+        lua_rawset(L, -4);
+        add_metamethods(L);
+        lua_pop(L, 1);
     }
-    static bool is(lua_State *L, int index)
+private:
+    // copies the metamethods of the class table on top of the stack into the
+    // metatable below it. An __index metamethod is only called for keys that
+    // are neither methods nor fields, __gc stays with the destruction policy.
+    static void add_metamethods(lua_State *L)
     {
-        return lua_isnumber(L, index);
+        lua_rawgeti(L, -1, std::is_const<element_type>::value ? 6 : 5);
+        lua_pushnil(L);
+        while(lua_next(L, -2) != 0)
+        {
+            lua_pushvalue(L, -2);
+            if(std::strcmp(lua_tostring(L, -1), "__gc") == 0)
+            {
+                lua_pop(L, 2);
+                continue;
+            }
+            if(std::strcmp(lua_tostring(L, -1), "__index") == 0)
+            {
+                lua_rawget(L, -6);
+                lua_pushvalue(L, -2);
+                lua_pushcclosure(L, class_index, 2);
+                lua_pushliteral(L, "__index");
+                lua_insert(L, -2);
+            }
+            else
+            {
+                lua_pushvalue(L, -2);
+            }
+            lua_rawset(L, -7);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
     }
-    static bool isconvertible(lua_State *L, int index)
+};
+
+// makes the metatable on top of the stack inherit the entries of the
+// metatables of the bases of T. Metamethods are copied since lua looks
+// them up with raw access, other entries are looked up through the
+// __index of the metatable's own metatable.
+template<class T>
+struct Inheritance {
+    static void link(lua_State*, bases<>)
     {
-        return is(L, index);
     }
-    static T get(lua_State *L, int index)
+    template<class... B>
+    static void link(lua_State *L, bases<B...>)
     {
-        return getexact(L, index);
+        int metatable = lua_gettop(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "__index");
+        int expand[] = {0, (push_base<B>(L, metatable), 0)...};
+        (void)expand;
+        if(sizeof...(B) > 1)
+            lua_pushcclosure(L, index_bases, sizeof...(B));
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
     }
-    static T getexact(lua_State *L, int index)
+private:
+    template<class B>
+    static void push_base(lua_State *L, int metatable)
     {
-        if(!is(L, index))
-            throw std::runtime_error("type mismatch");
-        return getunchecked(L, index);
+        StackHelper<typename rebind_storage<T, B>::type>::getmetatable(L);
+        copy_metamethods(L, -1, metatable);
     }
-    static T getunchecked(lua_State *L, int index)
+};
+
+template<class T>
+struct has_memory_size {
+    template<class U>
+    static char test(decltype(&memory_size<U>::get));
+    template<class U>
+    static long test(...);
+    static const bool value = sizeof(test<T>(0)) == 1;
+};
+
+// userdata that hold an object by value or unique_ptr own it
+template<class V>
+struct owns_object : std::is_same<typename storage_traits<V>::element_type, V> { };
+
+template<class T>
+struct owns_object< std::unique_ptr<T> > : std::true_type { };
+
+// live objects and external bytes of the types with memory_size
+template<class T>
+struct memory_counters {
+    static std::atomic<size_t> objects;
+    static std::atomic<size_t> bytes;
+};
+
+template<class T>
+std::atomic<size_t> memory_counters<T>::objects(0);
+
+template<class T>
+std::atomic<size_t> memory_counters<T>::bytes(0);
+
+// determines the userdata size for storage V and does the memory
+// accounting. Accounted userdata keep the reported size in a trailer after
+// the storage so destruction subtracts the same amount even if the object
+// changed in between.
+template<class V, class E = typename std::remove_const<typename storage_traits<V>::element_type>::type,
+         bool = owns_object<V>::value && has_memory_size<E>::value>
+struct MemoryAccount {
+    static const bool active = false;
+    static const size_t size = sizeof(V);
+    static void add(lua_State*, void*)
     {
-        return lua_tonumber(L, index);
     }
-    static void push(lua_State *L, T value)
+    static size_t take(const void*)
+    {
+        return 0;
+    }
+    static void release(size_t)
+    {
+    }
+    static void remove(const void*)
     {
-        lua_pushnumber(L, value);
     }
 };
 
-template<class T>
-struct StackHelper<T, typename std::enable_if<std::is_same<typename std::remove_const<T>::type, std::string>::value >::type> {
-    template<int Index>
-    static T get(lua_State *L)
+// the external memory reported by memory_size that the collector of a state
+// has not been stepped for yet
+struct memory_debt {
+    size_t bytes;
+};
+
+// kilobytes of debt paid off by a collector step per push. Larger steps
+// would run whole collection cycles for every large object.
+const size_t memory_step_limit = 1024;
+
+inline void add_memory_debt(lua_State *L, size_t bytes)
+{
+    rawgetp(L, LUA_REGISTRYINDEX, type_key<memory_debt>());
+    memory_debt *debt = static_cast<memory_debt*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    if(debt == nullptr)
     {
-        if(!lua_isstring(L, Index))
-        {
-            lua_pushfstring(L, "expected string in argument %d", Index);
-            lua_error(L);
-        }
-        return T(lua_tostring(L, Index));
+        debt = static_cast<memory_debt*>(newuserdata(L, sizeof(memory_debt)));
+        debt->bytes = 0;
+        rawsetp(L, LUA_REGISTRYINDEX, type_key<memory_debt>());
     }
-    static bool is(lua_State *L, int index)
+    debt->bytes += bytes;
+    // lua has no notion of external memory, but steps of the corresponding
+    // size pace the collector as if it had been allocated
+    size_t kbytes = std::min(debt->bytes/1024, memory_step_limit);
+    if(kbytes > 0)
     {
-        return lua_isstring(L, index);
+        debt->bytes -= kbytes*1024;
+        lua_gc(L, LUA_GCSTEP, static_cast<int>(kbytes));
     }
-    static bool isconvertible(lua_State *L, int index)
+}
+
+template<class V, class E>
+struct MemoryAccount<V, E, true> {
+    static const bool active = true;
+    static const size_t offset = (sizeof(V) + alignof(size_t) - 1)/alignof(size_t)*alignof(size_t);
+    static const size_t size = offset + sizeof(size_t);
+    static size_t& trailer(void *storage)
     {
-        return is(L, index);
+        return *reinterpret_cast<size_t*>(static_cast<char*>(storage) + offset);
     }
-    static T get(lua_State *L, int index)
+    static void add(lua_State *L, void *storage)
     {
-        return getexact(L, index);
+        const E *object = storage_traits<V>::get(*static_cast<V*>(storage));
+        size_t bytes = object != nullptr ? memory_size<E>::get(*object) : 0;
+        trailer(storage) = bytes;
+        ++memory_counters<E>::objects;
+        memory_counters<E>::bytes += bytes;
+        add_memory_debt(L, bytes);
     }
-    static T getexact(lua_State *L, int index)
+    // the reported size of an object that is about to be destroyed. The
+    // counters keep it until release is called after the destruction.
+    static size_t take(const void *storage)
     {
-        if(!is(L, index))
-            throw std::runtime_error("type mismatch");
-        return getunchecked(L, index);
+        return trailer(const_cast<void*>(storage));
     }
-    static T getunchecked(lua_State *L, int index)
+    static void release(size_t bytes)
     {
-        return T(lua_tostring(L, index));
+        --memory_counters<E>::objects;
+        memory_counters<E>::bytes -= bytes;
     }
-    static void push(lua_State *L, const T &value)
+    static void remove(const void *storage)
     {
-        lua_pushstring(L, value.c_str());
+        release(take(storage));
     }
 };
 
-template<class T>
-struct StackHelper<T, typename std::enable_if<std::is_same<T, const char*>::value >::type> {
-    template<int Index>
-    static T get(lua_State *L)
+// type erased object waiting for destruction
+struct deferred_object {
+    virtual ~deferred_object() { }
+};
+
+// the account is declared first, so it is released after the value was
+// destroyed
+template<class V>
+struct deferred_storage : deferred_object {
+    deferred_storage(V &&value, size_t bytes) : account(bytes), value(std::move(value)) { }
+    struct released_account {
+        explicit released_account(size_t bytes) : bytes(bytes) { }
+        ~released_account() { MemoryAccount<V>::release(bytes); }
+        size_t bytes;
+    } account;
+    V value;
+};
+
+// objects waiting for destruction in FIFO order
+class destruction_queue {
+public:
+    destruction_queue()
+    {
+        stats.pending = stats.peak_pending = stats.destroyed = 0;
+        stats.destroy_time = std::chrono::nanoseconds(0);
+    }
+    void push(std::unique_ptr<deferred_object> object)
+    {
+        objects.push_back(std::move(object));
+        stats.pending = objects.size();
+        stats.peak_pending = std::max(stats.peak_pending, stats.pending);
+    }
+    // destroys up to max_objects objects and returns how many were destroyed
+    size_t drain(size_t max_objects)
+    {
+        size_t count = std::min(max_objects, objects.size());
+        std::deque< std::unique_ptr<deferred_object> > batch;
+        std::move(objects.begin(), objects.begin() + count, std::back_inserter(batch));
+        objects.erase(objects.begin(), objects.begin() + count);
+        stats.pending = objects.size();
+        auto start = std::chrono::steady_clock::now();
+        batch.clear();
+        stats.destroy_time += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        stats.destroyed += count;
+        return count;
+    }
+    // moves up to max_objects objects to the end of other
+    void splice(destruction_queue &other, size_t max_objects)
     {
-        if(!lua_isstring(L, Index))
+        while(!objects.empty() && max_objects-- > 0)
         {
-            lua_pushfstring(L, "expected string in argument %d", Index);
-            lua_error(L);
+            other.push(std::move(objects.front()));
+            objects.pop_front();
         }
-        return lua_tostring(L, Index);
+        stats.pending = objects.size();
     }
-    static bool is(lua_State *L, int index)
+    destruction_stats stats;
+private:
+    std::deque< std::unique_ptr<deferred_object> > objects;
+};
+
+// the queue of a state lives in a userdata in the registry. Its __gc runs
+// when the state is closed, destroys the remaining objects and clears the
+// pointer so objects finalized after it are destroyed immediately.
+struct destruction_queue_box {
+    destruction_queue *queue;
+};
+
+inline int destroy_queue(lua_State *L)
+{
+    destruction_queue_box *box = static_cast<destruction_queue_box*>(lua_touserdata(L, 1));
+    destruction_queue *queue = box->queue;
+    box->queue = nullptr;
+    queue->drain(size_t(-1));
+    delete queue;
+    return 0;
+}
+
+inline destruction_queue* state_destruction_queue(lua_State *L, bool create)
+{
+    rawgetp(L, LUA_REGISTRYINDEX, type_key<destruction_queue>());
+    destruction_queue_box *box = static_cast<destruction_queue_box*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    if(box == nullptr && create)
     {
-        return lua_isstring(L, index);
+        box = static_cast<destruction_queue_box*>(newuserdata(L, sizeof(destruction_queue_box)));
+        box->queue = new destruction_queue();
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "__gc");
+        lua_pushcfunction(L, destroy_queue);
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
+        rawsetp(L, LUA_REGISTRYINDEX, type_key<destruction_queue>());
     }
-    static bool isconvertible(lua_State *L, int index)
+    return box != nullptr ? box->queue : nullptr;
+}
+
+// process wide thread that destroys objects with background_destruction.
+// It is never destroyed, so states closed during static destruction can
+// still push to it. After stop objects are destroyed by the pushing thread.
+class background_destroyer {
+public:
+    static background_destroyer& instance()
     {
-        return is(L, index);
+        static background_destroyer *destroyer = new background_destroyer();
+        return *destroyer;
     }
-    static T get(lua_State *L, int index)
+    void push(std::unique_ptr<deferred_object> object)
     {
-        return getexact(L, index);
+        std::unique_lock<std::mutex> lock(mutex);
+        if(stop)
+        {
+            lock.unlock();
+            destruction_queue batch;
+            batch.push(std::move(object));
+            batch.drain(size_t(-1));
+            lock.lock();
+            queue.stats.destroyed += batch.stats.destroyed;
+            queue.stats.destroy_time += batch.stats.destroy_time;
+            return;
+        }
+        queue.push(std::move(object));
+        wakeup.notify_one();
     }
-    static T getexact(lua_State *L, int index)
+    destruction_stats stats()
     {
-        if(!is(L, index))
-            throw std::runtime_error("type mismatch");
-        return getunchecked(L, index);
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.stats;
     }
-    static T getunchecked(lua_State *L, int index)
+    // destroys the pending objects and joins the thread
+    void shutdown()
     {
-        return lua_tostring(L, index);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(stop)
+                return;
+            stop = true;
+        }
+        wakeup.notify_one();
+        thread.join();
     }
-    static void push(lua_State *L, T value)
+private:
+    background_destroyer() : stop(false), thread(&background_destroyer::run, this) { }
+    void run()
     {
-        lua_pushstring(L, value);
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            wakeup.wait(lock, [this] { return stop || queue.stats.pending > 0; });
+            if(queue.stats.pending == 0)
+                return;
+            // destructors run outside the lock in small batches
+            destruction_queue batch;
+            queue.splice(batch, 64);
+            lock.unlock();
+            batch.drain(size_t(-1));
+            lock.lock();
+            queue.stats.destroyed += batch.stats.destroyed;
+            queue.stats.destroy_time += batch.stats.destroy_time;
+        }
     }
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    destruction_queue queue;
+    bool stop;
+    std::thread thread;
 };
 
-template<class T>
-struct StackHelper<T, typename std::enable_if<std::is_same<T, ref>::value >::type> {
-    template<int Index>
-    static T get(lua_State *L)
+// destroys the storage V of a userdata according to the destruction policy
+// of its element type. Raw pointers don't own their object.
+template<class V, class Policy = typename std::conditional<std::is_pointer<V>::value, immediate_destruction,
+    typename destruction_policy<typename std::remove_const<typename storage_traits<V>::element_type>::type>::type>::type>
+struct Destruction {
+    static const bool needs_gc = !std::is_trivially_destructible<V>::value;
+    static void prepare(lua_State*)
     {
-        lua_pushvalue(L, Index);
-        return ref(L, luaL_ref(L, LUA_REGISTRYINDEX));
     }
-    static bool is(lua_State *L, int index)
+    static void destroy(lua_State*, V *storage, size_t bytes)
     {
-        return true;
+        storage->~V();
+        MemoryAccount<V>::release(bytes);
     }
-    static bool isconvertible(lua_State *L, int index)
+};
+
+template<class V>
+struct Destruction<V, deferred_destruction> {
+    static const bool needs_gc = true;
+    // the queue is created with the metatable, so it is finalized after
+    // the objects when the state is closed
+    static void prepare(lua_State *L)
     {
-        return true;
+        state_destruction_queue(L, true);
     }
-    static T get(lua_State *L, int index)
+    static void destroy(lua_State *L, V *storage, size_t bytes)
     {
-        return getexact(L, index);
+        destruction_queue *queue = state_destruction_queue(L, false);
+        if(queue == nullptr)
+        {
+            storage->~V();
+            MemoryAccount<V>::release(bytes);
+            return;
+        }
+        queue->push(std::unique_ptr<deferred_object>(new deferred_storage<V>(std::move(*storage), bytes)));
+        storage->~V();
     }
-    static T getexact(lua_State *L, int index)
+};
+
+template<class V>
+struct Destruction<V, background_destruction> {
+    static const bool needs_gc = true;
+    static void prepare(lua_State*)
     {
-        return getunchecked(L, index);
+        background_destroyer::instance();
     }
-    static T getunchecked(lua_State *L, int index)
+    static void destroy(lua_State*, V *storage, size_t bytes)
     {
-        lua_pushvalue(L, index);
-        return ref(L, luaL_ref(L, LUA_REGISTRYINDEX));
+        background_destroyer::instance().push(std::unique_ptr<deferred_object>(new deferred_storage<V>(std::move(*storage), bytes)));
+        storage->~V();
     }
-    static void push(lua_State *L, const T &value)
+};
+
+// adds the metamethods of operator_metamethods to the metatable on top of
+// the stack
+template<class T, bool = operator_metamethods<T>::value>
+struct Operators {
+    static void add(lua_State*)
     {
-        if(L != value.L)
-            std::runtime_error("lua_State mismatch");
-        lua_rawgeti(L, LUA_REGISTRYINDEX, value.r);
     }
 };
 
 template<class T>
-struct StackHelper<T, typename std::enable_if<std::is_same<T, lua_State*>::value >::type> {
-    template<int Index>
-    static T get(lua_State *L)
+struct Operators<T, true>;
+
+// adds __pairs and __ipairs for range_metamethods to the metatable on top of
+// the stack
+template<class T, bool = range_metamethods<T>::value>
+struct Ranges {
+    static void add(lua_State*)
     {
-        return L;
+    }
+};
+
+template<class T>
+struct Ranges<T, true>;
+
+template<class T, class Enable>
+struct StackHelper {
+    typedef typename storage_traits<T>::element_type element_type;
+
+    static typename get_result<T>::type getarg(lua_State *L, int index)
+    {
+        return GetHelper<T>::getarg(L, index);
+    }
+    static typename get_result<T>::type get(lua_State *L, int index)
+    {
+        return GetHelper<T>::get(L, index);
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return GetHelper<T>::isconvertible(L, index);
+    }
+    static typename get_result<T>::type getexact(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            throw std::runtime_error("type mismatch");
+        return *userdata_storage<T>(lua_touserdata(L, index));
+    }
+    static typename get_result<T>::type getunchecked(lua_State *L, int index)
+    {
+        return *userdata_storage<T>(lua_touserdata(L, index));
+    }
+    static bool is(lua_State *L, int index)
+    {
+        if(!lua_isuserdata(L, index))
+            return false;
+        return userdataIs<T>(L, index);
+    }
+    static void push(lua_State *L, const T& value)
+    {
+        emplace(L, value);
+    }
+    static void push(lua_State *L, T&& value)
+    {
+        emplace(L, std::move(value));
+    }
+    template<class... Args>
+    static void emplace(lua_State *L, Args&&... args)
+    {
+        void *storage = newuserdata_storage<T>(L, MemoryAccount<T>::size);
+        // const objects are created non-const, so the destruction policies
+        // may move from them
+        new (storage) typename std::remove_const<T>::type(std::forward<Args>(args)...);
+        getmetatable(L);
+        lua_setmetatable(L, -2);
+        MemoryAccount<T>::add(L, storage);
+    }
+    static void getmetatable(lua_State *L)
+    {
+        // metatables are stored in the registry with the type key of T,
+        // threads share the registry with their main state
+        rawgetp(L, LUA_REGISTRYINDEX, type_key<T>());
+        if(lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            // objects that need no destruction and no memory accounting get
+            // no finalizer, which makes them cheaper to collect
+            if(Destruction<typename std::remove_const<T>::type>::needs_gc || MemoryAccount<T>::active)
+            {
+                lua_pushliteral(L, "__gc");
+                lua_pushcfunction(L, destroy_T);
+                lua_rawset(L, -3);
+            }
+            Destruction<typename std::remove_const<T>::type>::prepare(L);
+            set_storage_entry<T>(L);
+            CastTable<T, typename std::remove_const<element_type>::type>::add(L);
+            lua_pushvalue(L, -1);
+            rawsetp(L, LUA_REGISTRYINDEX, type_key<T>());
+
+            ClassIndex<T>::add(L);
+            Operators<typename std::remove_const<element_type>::type>::add(L);
+            Ranges<typename std::remove_const<element_type>::type>::add(L);
+            register_hook<T>::on_register(L);
+            Inheritance<T>::link(L, typename base_classes<typename std::remove_const<element_type>::type>::type());
+        }
+    }
+private:
+    static int destroy_T(lua_State *L)
+    {
+        T *storage = userdata_storage<T>(lua_touserdata(L, -1));
+        Destruction<typename std::remove_const<T>::type>::destroy(L, const_cast<typename std::remove_const<T>::type*>(storage), MemoryAccount<T>::take(storage));
+        return 0;
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_lvalue_reference<T>::value>::type>
+    : public StackHelper<typename  std::remove_reference<T>::type >
+{
+};
+
+// true for types that are stored in userdata
+template<class T>
+struct is_userdata_type {
+    template<class U>
+    static char test(typename StackHelper<U>::element_type*);
+    template<class U>
+    static long test(...);
+    static const bool value = sizeof(test<T>(0)) == 1;
+};
+
+// only looks at StackHelper<T> for rvalue references, since the
+// specialization below is considered when instantiating StackHelper<T>
+template<class T>
+struct is_userdata_rvalue : std::false_type { };
+
+template<class T>
+struct is_userdata_rvalue<T&&> : std::integral_constant<bool, is_userdata_type<T>::value> { };
+
+// userdata whose object has been moved out get this metatable. It has no
+// __gc and any access raises an error.
+inline int moved_from_error(lua_State *L)
+{
+    lua_pushstring(L, "attempt to use a moved-from object");
+    return lua_error(L);
+}
+
+inline void push_moved_from_metatable(lua_State *L)
+{
+    struct moved_from;
+    rawgetp(L, LUA_REGISTRYINDEX, type_key<moved_from>());
+    if(lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 2);
+        lua_pushliteral(L, "__index");
+        lua_pushcfunction(L, moved_from_error);
+        lua_rawset(L, -3);
+        lua_pushliteral(L, "__newindex");
+        lua_pushcfunction(L, moved_from_error);
+        lua_rawset(L, -3);
+        lua_pushvalue(L, -1);
+        rawsetp(L, LUA_REGISTRYINDEX, type_key<moved_from>());
+    }
+}
+
+// rvalue references to userdata types move the object out of a userdata
+// holding it by value. The moved-from object is destroyed right away and
+// the userdata gets the moved-from metatable.
+template<class T>
+struct StackHelper<T, typename std::enable_if<is_userdata_rvalue<T>::value>::type> {
+    typedef typename std::remove_reference<T>::type value_type;
+
+    static value_type getarg(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            argument_error(L, index, "movable userdata");
+        return take(L, index);
+    }
+    static value_type get(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            throw std::runtime_error("type mismatch");
+        return take(L, index);
+    }
+    static value_type getexact(lua_State *L, int index)
+    {
+        return get(L, index);
+    }
+    static value_type getunchecked(lua_State *L, int index)
+    {
+        return take(L, index);
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return is(L, index);
+    }
+    static bool is(lua_State *L, int index)
+    {
+        return !std::is_const<value_type>::value && lua_isuserdata(L, index) &&
+               userdataIs<value_type>(L, index);
+    }
+    // the check of a call argument. Calls move the object out with take
+    // after all their arguments were converted.
+    static void checkarg(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            argument_error(L, index, "movable userdata");
+        // the object can't be passed again, it is gone when the call is made
+        for(int i = 1; i <= lua_gettop(L); ++i)
+        {
+            if(i != index && lua_rawequal(L, i, index))
+                argument_error(L, index, "movable userdata passed once");
+        }
+        push_moved_from_metatable(L);
+        lua_pop(L, 1);
+    }
+    // the metatable is pushed before the object is touched, so nothing
+    // raises a lua error while the moved value is in flight
+    static value_type take(lua_State *L, int index)
+    {
+        index = absindex(L, index);
+        push_moved_from_metatable(L);
+        value_type *object = userdata_storage<value_type>(lua_touserdata(L, index));
+        value_type result(std::move(*object));
+        MemoryAccount<value_type>::remove(object);
+        object->~value_type();
+        lua_setmetatable(L, index);
+        return result;
+    }
+};
+
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<typename std::remove_cv<T>::type, bool>::value >::type> {
+    static T getarg(lua_State *L, int index)
+    {
+        int isnum;
+        lua_Integer value = tointegerx(L, index, &isnum);
+        if(!isnum)
+            argument_error(L, index, "number");
+        return static_cast<T>(value);
+    }
+    static bool is(lua_State *L, int index)
+    {
+        return lua_isnumber(L, index);
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return is(L, index);
+    }
+    static T get(lua_State *L, int index)
+    {
+        return getexact(L, index);
+    }
+    static T getexact(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            throw std::runtime_error("type mismatch");
+        return getunchecked(L, index);
+    }
+    static T getunchecked(lua_State *L, int index)
+    {
+        int isnum;
+        return static_cast<T>(tointegerx(L, index, &isnum));
+    }
+    static void push(lua_State *L, T value)
+    {
+        lua_pushinteger(L, static_cast<lua_Integer>(value));
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_same<typename std::remove_cv<T>::type, bool>::value >::type> {
+    static T getarg(lua_State *L, int index)
+    {
+        if(!lua_isboolean(L, index))
+            argument_error(L, index, "boolean");
+        return lua_toboolean(L, index);
+    }
+    static bool is(lua_State *L, int index)
+    {
+        return lua_isboolean(L, index);
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return is(L, index);
+    }
+    static T get(lua_State *L, int index)
+    {
+        return getexact(L, index);
+    }
+    static T getexact(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            throw std::runtime_error("type mismatch");
+        return getunchecked(L, index);
+    }
+    static T getunchecked(lua_State *L, int index)
+    {
+        return lua_toboolean(L, index);
+    }
+    static void push(lua_State *L, T value)
+    {
+        lua_pushboolean(L, value);
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_floating_point<T>::value >::type> {
+    static T getarg(lua_State *L, int index)
+    {
+        int isnum;
+        lua_Number value = tonumberx(L, index, &isnum);
+        if(!isnum)
+            argument_error(L, index, "number");
+        return static_cast<T>(value);
+    }
+    static bool is(lua_State *L, int index)
+    {
+        return lua_isnumber(L, index);
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return is(L, index);
+    }
+    static T get(lua_State *L, int index)
+    {
+        return getexact(L, index);
+    }
+    static T getexact(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            throw std::runtime_error("type mismatch");
+        return getunchecked(L, index);
+    }
+    static T getunchecked(lua_State *L, int index)
+    {
+        return lua_tonumber(L, index);
+    }
+    static void push(lua_State *L, T value)
+    {
+        lua_pushnumber(L, value);
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_same<typename std::remove_const<T>::type, std::string>::value >::type> {
+    static T getarg(lua_State *L, int index)
+    {
+        if(!lua_isstring(L, index))
+            argument_error(L, index, "string");
+        return getunchecked(L, index);
+    }
+    static bool is(lua_State *L, int index)
+    {
+        return lua_isstring(L, index);
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return is(L, index);
+    }
+    static T get(lua_State *L, int index)
+    {
+        return getexact(L, index);
+    }
+    static T getexact(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            throw std::runtime_error("type mismatch");
+        return getunchecked(L, index);
+    }
+    // strings can contain zeros
+    static T getunchecked(lua_State *L, int index)
+    {
+        size_t length;
+        const char *data = lua_tolstring(L, index, &length);
+        return T(data, length);
+    }
+    static void push(lua_State *L, const T &value)
+    {
+        lua_pushlstring(L, value.data(), value.size());
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_same<T, const char*>::value >::type> {
+    static T getarg(lua_State *L, int index)
+    {
+        if(!lua_isstring(L, index))
+            argument_error(L, index, "string");
+        return lua_tostring(L, index);
+    }
+    static bool is(lua_State *L, int index)
+    {
+        return lua_isstring(L, index);
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return is(L, index);
+    }
+    static T get(lua_State *L, int index)
+    {
+        return getexact(L, index);
+    }
+    static T getexact(lua_State *L, int index)
+    {
+        if(!is(L, index))
+            throw std::runtime_error("type mismatch");
+        return getunchecked(L, index);
+    }
+    static T getunchecked(lua_State *L, int index)
+    {
+        return lua_tostring(L, index);
+    }
+    static void push(lua_State *L, T value)
+    {
+        lua_pushstring(L, value);
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_same<T, ref>::value >::type> {
+    static T getarg(lua_State *L, int index)
+    {
+        lua_pushvalue(L, index);
+        return ref(L, luaL_ref(L, LUA_REGISTRYINDEX));
+    }
+    static bool is(lua_State *L, int index)
+    {
+        return true;
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        return true;
+    }
+    static T get(lua_State *L, int index)
+    {
+        return getexact(L, index);
+    }
+    static T getexact(lua_State *L, int index)
+    {
+        return getunchecked(L, index);
+    }
+    static T getunchecked(lua_State *L, int index)
+    {
+        lua_pushvalue(L, index);
+        return ref(L, luaL_ref(L, LUA_REGISTRYINDEX));
+    }
+    static void push(lua_State *L, const T &value)
+    {
+        if(L != value.L)
+            std::runtime_error("lua_State mismatch");
+        lua_rawgeti(L, LUA_REGISTRYINDEX, value.r);
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_same<T, weak_ref>::value >::type> {
+    static T getarg(lua_State *L, int index)
+    {
+        return weak_ref(L, index);
+    }
+    static bool is(lua_State*, int)
+    {
+        return true;
+    }
+    static bool isconvertible(lua_State*, int)
+    {
+        return true;
+    }
+    static T get(lua_State *L, int index)
+    {
+        return weak_ref(L, index);
+    }
+    static T getexact(lua_State *L, int index)
+    {
+        return weak_ref(L, index);
+    }
+    static T getunchecked(lua_State *L, int index)
+    {
+        return weak_ref(L, index);
+    }
+    static void push(lua_State *L, const T &value)
+    {
+        value.push(L);
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_same<T, value>::value >::type> {
+    static T getarg(lua_State *L, int index)
+    {
+        return getunchecked(L, index);
+    }
+    static bool is(lua_State*, int)
+    {
+        return true;
+    }
+    static bool isconvertible(lua_State*, int)
+    {
+        return true;
+    }
+    static T get(lua_State *L, int index)
+    {
+        return getunchecked(L, index);
+    }
+    static T getexact(lua_State *L, int index)
+    {
+        return getunchecked(L, index);
+    }
+    static T getunchecked(lua_State *L, int index)
+    {
+        value result;
+        result.ltype = static_cast<unsigned char>(std::max(lua_type(L, index), LUA_TNIL));
+        switch(result.ltype)
+        {
+        case LUA_TNIL:
+            break;
+        case LUA_TBOOLEAN:
+            result.kind = value::boolean_kind;
+            result.data.boolean = lua_toboolean(L, index) != 0;
+            break;
+        case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+            if(lua_isinteger(L, index))
+            {
+                result.kind = value::integer_kind;
+                result.data.integer = lua_tointeger(L, index);
+                break;
+            }
+#endif
+            result.kind = value::number_kind;
+            result.data.number = lua_tonumber(L, index);
+            break;
+        case LUA_TLIGHTUSERDATA:
+            result.kind = value::lightuserdata_kind;
+            result.data.pointer = lua_touserdata(L, index);
+            break;
+        case LUA_TSTRING:
+        {
+            size_t length;
+            const char *chars = lua_tolstring(L, index, &length);
+            if(length <= value::inline_capacity)
+            {
+                result.kind = value::string_kind;
+                result.length = static_cast<unsigned char>(length);
+                std::copy(chars, chars + length, result.data.chars);
+            }
+            else
+            {
+                reference(L, index, result);
+            }
+            break;
+        }
+        default:
+            reference(L, index, result);
+        }
+        return result;
+    }
+    static void reference(lua_State *L, int index, value &result)
+    {
+        lua_pushvalue(L, index);
+        result.kind = value::reference_kind;
+        result.data.reference.L = main_thread(L);
+        result.data.reference.r = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    static void push(lua_State *L, const T &value)
+    {
+        switch(value.kind)
+        {
+        case T::nil_kind:
+            lua_pushnil(L);
+            break;
+        case T::boolean_kind:
+            lua_pushboolean(L, value.data.boolean);
+            break;
+        case T::integer_kind:
+            lua_pushinteger(L, value.data.integer);
+            break;
+        case T::number_kind:
+            lua_pushnumber(L, value.data.number);
+            break;
+        case T::string_kind:
+            lua_pushlstring(L, value.data.chars, value.length);
+            break;
+        case T::lightuserdata_kind:
+            lua_pushlightuserdata(L, value.data.pointer);
+            break;
+        default:
+            lua_rawgeti(L, LUA_REGISTRYINDEX, value.data.reference.r);
+        }
+    }
+};
+
+template<class T>
+struct StackHelper<T, typename std::enable_if<std::is_same<T, lua_State*>::value >::type> {
+    static T getarg(lua_State *L, int)
+    {
+        return L;
+    }
+    static bool is(lua_State*, int)
+    {
+        return true;
+    }
+    static T getunchecked(lua_State *L, int)
+    {
+        return L;
+    }
+};
+
+template<class T>
+struct StackHelper< varargs<T> > {
+    static varargs<T> getarg(lua_State *L, int index)
+    {
+        return varargs<T>(L, index);
+    }
+    static bool is(lua_State*, int)
+    {
+        return true;
+    }
+    static varargs<T> getunchecked(lua_State *L, int index)
+    {
+        return varargs<T>(L, index);
     }
 };
 
@@ -643,285 +2809,1796 @@ template<class T, size_t I>
 struct TupleStackHelper {
     static void push(lua_State *L, const T &values)
     {
-        TupleStackHelper<T, I-1>::push(L, values);
-        StackHelper<typename std::tuple_element<I-1, T>::type>::push(L, std::get<I-1>(values));
+        TupleStackHelper<T, I-1>::push(L, values);
+        StackHelper<typename std::tuple_element<I-1, T>::type>::push(L, std::get<I-1>(values));
+    }
+};
+
+template<class T>
+struct TupleStackHelper<T, 0> {
+    static void push(lua_State*, const T&)
+    {
+    }
+};
+
+template<class... Args>
+struct StackHelper<std::tuple<Args...>, void> {
+    static void push(lua_State *L, const std::tuple<Args...> &values)
+    {
+        TupleStackHelper<std::tuple<Args...>, sizeof...(Args) >::push(L, values);
+    }
+};
+
+template<class C>
+struct TableFieldCount;
+
+template<class T>
+struct has_table_schema {
+    template<class U>
+    static char test(decltype(table_schema<U>::describe(std::declval< TableFieldCount<U>& >()))*);
+    template<class U>
+    static long test(...);
+    static const bool value = sizeof(test<T>(0)) == 1;
+};
+
+template<class T>
+struct TableCodec;
+
+// converts the fields of table schemas. decode converts the value at index
+// of lua type type into value, on failure it pushes an error message and
+// returns false.
+template<class T, class Enable = void>
+struct TableValue {
+    static bool decode(lua_State *L, int index, int, T &value)
+    {
+        if(!StackHelper<T>::isconvertible(L, index))
+        {
+            lua_pushfstring(L, "unexpected %s", lua_typename(L, lua_type(L, index)));
+            return false;
+        }
+        value = StackHelper<T>::get(L, index);
+        return true;
+    }
+    static void push(lua_State *L, const T &value)
+    {
+        StackHelper<T>::push(L, value);
+    }
+};
+
+// numbers take a single call, numeric strings are converted as well
+template<class T>
+struct TableValue<T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value>::type> {
+    static bool decode(lua_State *L, int index, int type, T &value)
+    {
+#if LUA_VERSION_NUM < 503
+        if(type == LUA_TNUMBER && std::is_integral<T>::value)
+        {
+            value = static_cast<T>(lua_tointeger(L, index));
+            return true;
+        }
+#endif
+        if(type == LUA_TNUMBER && !std::is_integral<T>::value)
+        {
+            value = static_cast<T>(lua_tonumber(L, index));
+            return true;
+        }
+        int isnum;
+        if(std::is_integral<T>::value)
+            value = static_cast<T>(tointegerx(L, index, &isnum));
+        else
+            value = static_cast<T>(tonumberx(L, index, &isnum));
+        if(!isnum)
+            lua_pushfstring(L, "expected number but got %s", lua_typename(L, type));
+        return isnum != 0;
+    }
+    static void push(lua_State *L, T value)
+    {
+        StackHelper<T>::push(L, value);
+    }
+};
+
+template<>
+struct TableValue<bool> {
+    static bool decode(lua_State *L, int index, int type, bool &value)
+    {
+        if(type != LUA_TBOOLEAN)
+        {
+            lua_pushfstring(L, "expected boolean but got %s", lua_typename(L, type));
+            return false;
+        }
+        value = lua_toboolean(L, index) != 0;
+        return true;
+    }
+    static void push(lua_State *L, bool value)
+    {
+        lua_pushboolean(L, value);
+    }
+};
+
+template<>
+struct TableValue<std::string> {
+    static bool decode(lua_State *L, int index, int type, std::string &value)
+    {
+        if(type != LUA_TSTRING)
+        {
+            lua_pushfstring(L, "expected string but got %s", lua_typename(L, type));
+            return false;
+        }
+        size_t length;
+        const char *data = lua_tolstring(L, index, &length);
+        value.assign(data, length);
+        return true;
+    }
+    static void push(lua_State *L, const std::string &value)
+    {
+        lua_pushlstring(L, value.data(), value.size());
+    }
+};
+
+template<class T>
+struct TableValue<T, typename std::enable_if<has_table_schema<T>::value>::type> {
+    static bool decode(lua_State *L, int index, int type, T &value)
+    {
+        return TableCodec<T>::decode(L, index, type, value);
+    }
+    static void push(lua_State *L, const T &value)
+    {
+        TableCodec<T>::encode(L, value);
+    }
+};
+
+// arrays of structs grow the stack for the field values once instead of
+// once per element
+template<class E, bool = has_table_schema<E>::value>
+struct ArrayElement {
+    static void prepare(lua_State*)
+    {
+    }
+    static bool decode(lua_State *L, int index, int type, E &value)
+    {
+        return TableValue<E>::decode(L, index, type, value);
+    }
+};
+
+template<class E>
+struct ArrayElement<E, true> {
+    static void prepare(lua_State *L)
+    {
+        luaL_checkstack(L, TableCodec<E>::field_count(), "table schema");
+    }
+    static bool decode(lua_State *L, int index, int type, E &value)
+    {
+        if(type != LUA_TTABLE)
+        {
+            lua_pushfstring(L, "expected table but got %s", lua_typename(L, type));
+            return false;
+        }
+        return TableCodec<E>::decode_fields(L, index, index, value);
+    }
+};
+
+template<class E>
+struct TableValue< std::vector<E> > {
+    static bool decode(lua_State *L, int index, int type, std::vector<E> &values)
+    {
+        if(type != LUA_TTABLE)
+        {
+            lua_pushfstring(L, "expected table but got %s", lua_typename(L, type));
+            return false;
+        }
+        index = absindex(L, index);
+        int top = lua_gettop(L);
+        ArrayElement<E>::prepare(L);
+        values.resize(rawlen(L, index));
+        for(size_t i = 0; i < values.size(); ++i)
+        {
+            int element = rawgeti(L, index, i+1);
+            if(!ArrayElement<E>::decode(L, top + 1, element, values[i]))
+            {
+                lua_pushfstring(L, "element %d: %s", int(i+1), lua_tostring(L, -1));
+                lua_replace(L, top + 1);
+                lua_settop(L, top + 1);
+                return false;
+            }
+            lua_settop(L, top);
+        }
+        return true;
+    }
+    static void push(lua_State *L, const std::vector<E> &values)
+    {
+        lua_createtable(L, values.size(), 0);
+        for(size_t i = 0; i < values.size(); ++i)
+        {
+            TableValue<E>::push(L, values[i]);
+            lua_rawseti(L, -2, i+1);
+        }
+    }
+};
+
+// counts the fields of a table schema
+template<class C>
+struct TableFieldCount {
+    TableFieldCount() : count(0) { }
+    template<class M>
+    TableFieldCount& field(const char*, M C::*)
+    {
+        ++count;
+        return *this;
+    }
+    template<class M>
+    TableFieldCount& optional_field(const char*, M C::*)
+    {
+        ++count;
+        return *this;
+    }
+    int count;
+};
+
+// decodes the fields of a table schema from the table at index. The field
+// values stay on the stack, after a failure the error message is left at
+// top + 1 and the remaining fields are skipped.
+template<class C>
+struct TableDecoder {
+    TableDecoder(lua_State *L, int index, int top, C &object)
+    : L(L), index(index), top(top), object(object), ok(true)
+    {
+    }
+    template<class M>
+    TableDecoder& field(const char *name, M C::*member)
+    {
+        return decode(name, object.*member, false);
+    }
+    template<class M>
+    TableDecoder& optional_field(const char *name, M C::*member)
+    {
+        return decode(name, object.*member, true);
+    }
+    lua_State *L;
+    int index;
+    int top;
+    C &object;
+    bool ok;
+private:
+    template<class M>
+    TableDecoder& decode(const char *name, M &value, bool optional)
+    {
+        if(!ok)
+            return *this;
+        int type = getfield(L, index, name);
+        if(type == LUA_TNIL)
+        {
+            if(optional)
+                return *this;
+            lua_pushfstring(L, "missing field '%s'", name);
+        }
+        else if(TableValue<M>::decode(L, -1, type, value))
+        {
+            return *this;
+        }
+        else
+        {
+            lua_pushfstring(L, "field '%s': %s", name, lua_tostring(L, -1));
+        }
+        lua_replace(L, top + 1);
+        lua_settop(L, top + 1);
+        ok = false;
+        return *this;
+    }
+};
+
+// sets the fields of a table schema in the table on top of the stack
+template<class C>
+struct TableEncoder {
+    TableEncoder(lua_State *L, const C &object) : L(L), object(object) { }
+    template<class M>
+    TableEncoder& field(const char *name, M C::*member)
+    {
+        TableValue<M>::push(L, object.*member);
+        lua_setfield(L, -2, name);
+        return *this;
+    }
+    template<class M>
+    TableEncoder& optional_field(const char *name, M C::*member)
+    {
+        return field(name, member);
+    }
+    lua_State *L;
+    const C &object;
+};
+
+// converts between tables and structs with a table_schema. describe is
+// instantiated with a decoder and an encoder, so each field is a
+// lua_getfield or lua_setfield and a conversion for its type.
+template<class C>
+struct TableCodec {
+    static int field_count()
+    {
+        static const int count = describe(TableFieldCount<C>()).count;
+        return count;
+    }
+    static bool decode(lua_State *L, int index, C &object)
+    {
+        return decode(L, index, lua_type(L, index), object);
+    }
+    static bool decode(lua_State *L, int index, int type, C &object)
+    {
+        if(type != LUA_TTABLE)
+        {
+            lua_pushfstring(L, "expected table but got %s", lua_typename(L, type));
+            return false;
+        }
+        int top = lua_gettop(L);
+        luaL_checkstack(L, field_count(), "table schema");
+        if(!decode_fields(L, index < 0 && index > LUA_REGISTRYINDEX ? top + index + 1 : index, top, object))
+            return false;
+        lua_settop(L, top);
+        return true;
+    }
+    // decodes the table at index and leaves the field values above top. On
+    // failure the error message is left at top + 1 instead.
+    static bool decode_fields(lua_State *L, int index, int top, C &object)
+    {
+        TableDecoder<C> decoder(L, index, top, object);
+        table_schema<C>::describe(decoder);
+        return decoder.ok;
+    }
+    static void encode(lua_State *L, const C &object)
+    {
+        lua_createtable(L, 0, field_count());
+        TableEncoder<C> encoder(L, object);
+        table_schema<C>::describe(encoder);
+    }
+private:
+    template<class S>
+    static S describe(S s)
+    {
+        table_schema<C>::describe(s);
+        return s;
+    }
+};
+
+// types with a table_schema are passed as tables
+template<class T>
+struct StackHelper<T, typename std::enable_if<has_table_schema<typename std::remove_const<T>::type>::value>::type> {
+    typedef typename std::remove_const<T>::type value_type;
+
+    // the partially decoded result is destroyed before lua_error unwinds
+    static value_type getarg(lua_State *L, int index)
+    {
+        {
+            value_type result;
+            if(TableCodec<value_type>::decode(L, index, result))
+                return result;
+        }
+        lua_pushfstring(L, "argument %d: %s", index, lua_tostring(L, -1));
+        lua_error(L);
+        return value_type();
+    }
+    static value_type get(lua_State *L, int index)
+    {
+        value_type result;
+        if(!TableCodec<value_type>::decode(L, index, result))
+        {
+            std::string message = lua_tostring(L, -1);
+            lua_pop(L, 1);
+            throw std::runtime_error(message);
+        }
+        return result;
+    }
+    static value_type getexact(lua_State *L, int index)
+    {
+        return get(L, index);
+    }
+    static value_type getunchecked(lua_State *L, int index)
+    {
+        return getarg(L, index);
+    }
+    static bool is(lua_State *L, int index)
+    {
+        return lua_istable(L, index);
+    }
+    static bool isconvertible(lua_State *L, int index)
+    {
+        value_type result;
+        if(TableCodec<value_type>::decode(L, index, result))
+            return true;
+        lua_pop(L, 1);
+        return false;
+    }
+    static void push(lua_State *L, const value_type &value)
+    {
+        TableCodec<value_type>::encode(L, value);
+    }
+};
+
+template<class T>
+struct return_value_count {
+    static const size_t value = 1;
+};
+
+template<>
+struct return_value_count<void> {
+    static const size_t value = 0;
+};
+
+template<class... Args>
+struct return_value_count< std::tuple<Args...> > {
+    static const size_t value = sizeof...(Args);
+};
+
+
+template<class T>
+struct is_call_policy {
+    static const bool value = std::is_same<T, checked>::value ||
+                              std::is_same<T, unchecked>::value ||
+                              std::is_same<T, debug_checked>::value;
+};
+
+template<class T>
+struct is_varargs : std::false_type { };
+
+template<class T>
+struct is_varargs< varargs<T> > : std::true_type { };
+
+// true if no argument but the last one is a varargs
+template<class... Args>
+struct varargs_last : std::true_type { };
+
+template<class A, class B, class... Rest>
+struct varargs_last<A, B, Rest...>
+: std::integral_constant<bool, !is_varargs<A>::value && varargs_last<B, Rest...>::value> { };
+
+template<class Policy>
+struct CallPolicy;
+
+template<>
+struct CallPolicy<checked> {
+    template<class T>
+    static auto get(lua_State *L, int index) -> decltype(StackHelper<T>::getarg(L, index))
+    {
+        return StackHelper<T>::getarg(L, index);
+    }
+    template<class T>
+    static void check(lua_State *L, int index)
+    {
+        StackHelper<T>::checkarg(L, index);
+    }
+    // open calls end with a lua_State* or varargs parameter that takes no
+    // fixed argument
+    static void check_arity(lua_State *L, int count, bool open)
+    {
+        if(!open)
+        {
+            if(lua_gettop(L) != count)
+            {
+                lua_pushfstring(L, "expected %d arguments but got %d", count, lua_gettop(L));
+                lua_error(L);
+            }
+        }
+        else
+        {
+            if(lua_gettop(L) < count-1)
+            {
+                lua_pushfstring(L, "expected at least %d arguments but got %d", count-1, lua_gettop(L));
+                lua_error(L);
+            }
+        }
+    }
+};
+
+template<>
+struct CallPolicy<unchecked> {
+    template<class T>
+    static auto get(lua_State *L, int index) -> decltype(StackHelper<T>::getunchecked(L, index))
+    {
+        return StackHelper<T>::getunchecked(L, index);
+    }
+    template<class T>
+    static void check(lua_State*, int)
+    {
+    }
+    static void check_arity(lua_State*, int, bool)
+    {
+    }
+};
+
+template<>
+struct CallPolicy<debug_checked> {
+    // getunchecked reads objects pushed as T and as its non-const type alike
+    template<class T>
+    static bool readable(lua_State *L, int index)
+    {
+        typedef typename std::remove_const<typename std::remove_reference<T>::type>::type U;
+        return StackHelper<T>::is(L, index) || StackHelper<U>::is(L, index);
+    }
+    template<class T>
+    static auto get(lua_State *L, int index) -> decltype(StackHelper<T>::getunchecked(L, index))
+    {
+        assert(readable<T>(L, index));
+        return StackHelper<T>::getunchecked(L, index);
+    }
+    template<class T>
+    static void check(lua_State *L, int index)
+    {
+        assert(readable<T>(L, index));
+        (void)L; (void)index;
+    }
+    static void check_arity(lua_State *L, int count, bool open)
+    {
+        assert(open ? lua_gettop(L) >= count-1 : lua_gettop(L) == count);
+        (void)L; (void)count; (void)open;
+    }
+};
+
+// true for the wrappers of member functions. Their first argument is the
+// object, which is looked up in the cast table with the checked policy
+// whatever the call policy is, since it is rarely a C* userdata.
+template<class T>
+struct is_member_call : std::false_type { };
+
+template<class Policy, bool self>
+struct argument_policy {
+    typedef Policy type;
+};
+
+template<class Policy>
+struct argument_policy<Policy, true> {
+    typedef checked type;
+};
+
+template<class... Args>
+struct has_userdata_rvalue : std::false_type { };
+
+template<class A, class... Rest>
+struct has_userdata_rvalue<A, Rest...>
+: std::integral_constant<bool, is_userdata_rvalue<A>::value || has_userdata_rvalue<Rest...>::value> { };
+
+// a converted call argument of calls with rvalue userdata arguments. Those
+// are only checked during conversion and moved out when the call is made,
+// so a failing conversion of a later argument leaves them untouched.
+template<class Policy, class A, class Enable = void>
+struct CallArgument {
+    typedef decltype(CallPolicy<Policy>::template get<A>(nullptr, 0)) type;
+    static type get(lua_State *L, int index)
+    {
+        return CallPolicy<Policy>::template get<A>(L, index);
+    }
+    static type&& pass(lua_State*, type &value)
+    {
+        return std::forward<type>(value);
+    }
+};
+
+template<class Policy, class A>
+struct CallArgument<Policy, A, typename std::enable_if<is_userdata_rvalue<A>::value>::type> {
+    typedef int type;
+    static int get(lua_State *L, int index)
+    {
+        CallPolicy<Policy>::template check<A>(L, index);
+        return index;
+    }
+    static typename StackHelper<A>::value_type pass(lua_State *L, int index)
+    {
+        return StackHelper<A>::take(L, index);
+    }
+};
+
+// pushes the result of the call of a CallHelper and returns the number of
+// values it left on the stack
+template<class R>
+struct ReturnHelper {
+    template<class H>
+    static int call(lua_State *L, H &helper)
+    {
+        StackHelper<R>::push(L, helper(L));
+        return return_value_count<R>::value;
+    }
+};
+
+template<>
+struct ReturnHelper<void> {
+    template<class H>
+    static int call(lua_State *L, H &helper)
+    {
+        helper(L);
+        return 0;
+    }
+};
+
+template<>
+struct ReturnHelper<luareturn> {
+    template<class H>
+    static int call(lua_State *L, H &helper)
+    {
+        return helper(L).count;
+    }
+};
+
+// finds the userdata that receives the result of a call (see
+// result_destination) and pushes the result
+template<class R, class Enable = void>
+struct ResultDestination {
+    static int find(lua_State*, int, bool)
+    {
+        return 0;
+    }
+    template<class H>
+    static int call(lua_State *L, H &helper, int)
+    {
+        return ReturnHelper<R>::call(L, helper);
+    }
+};
+
+template<class R>
+struct ResultDestination<R, typename std::enable_if<result_destination<R>::value>::type> {
+    static_assert(std::is_trivially_copyable<R>::value, "result_destination needs a trivially copyable type");
+
+    // the argument after the count regular ones if it is a userdata of type
+    // R. Functions with open argument lists never take a destination.
+    static int find(lua_State *L, int count, bool open)
+    {
+        if(open || lua_gettop(L) != count + 1 || !StackHelper<R>::is(L, count + 1))
+            return 0;
+        return count + 1;
+    }
+    template<class H>
+    static int call(lua_State *L, H &helper, int destination)
+    {
+        if(destination == 0)
+            return ReturnHelper<R>::call(L, helper);
+        *userdata_storage<R>(lua_touserdata(L, destination)) = helper(L);
+        lua_pushvalue(L, destination);
+        return 1;
+    }
+};
+
+// callables that need a destructor are preceded by a pointer to it in their
+// userdata. They all share one metatable whose __gc calls that pointer.
+struct callable_header {
+    void (*destroy)(void *userdata);
+};
+
+inline int destroy_callable(lua_State *L)
+{
+    void *userdata = lua_touserdata(L, 1);
+    static_cast<callable_header*>(userdata)->destroy(userdata);
+    return 0;
+}
+
+inline void push_callable_metatable(lua_State *L)
+{
+    rawgetp(L, LUA_REGISTRYINDEX, type_key<callable_header>());
+    if(lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "__gc");
+        lua_pushcfunction(L, destroy_callable);
+        lua_rawset(L, -3);
+        lua_pushvalue(L, -1);
+        rawsetp(L, LUA_REGISTRYINDEX, type_key<callable_header>());
+    }
+}
+
+// stores a callable of type H in a new userdata. Trivially destructible
+// callables (function pointers, member function wrappers) get no metatable.
+template<class H, bool = std::is_trivially_destructible<H>::value>
+struct CallableStorage {
+    template<class F>
+    static void push(lua_State *L, F&& f)
+    {
+        new (newuserdata_storage<H>(L, sizeof(H))) H(std::forward<F>(f));
+    }
+    static H* get(void *userdata)
+    {
+        return userdata_storage<H>(userdata);
+    }
+};
+
+template<class H>
+struct CallableStorage<H, false> {
+    static const size_t header_size =
+        (sizeof(callable_header) + alignof(userdata_align) - 1)/alignof(userdata_align)*alignof(userdata_align);
+    template<class F>
+    static void push(lua_State *L, F&& f)
+    {
+        void *userdata = newuserdata(L, header_size + UserdataLayout<H>::padding + sizeof(H));
+        new (get(userdata)) H(std::forward<F>(f));
+        static_cast<callable_header*>(userdata)->destroy = destroy;
+        push_callable_metatable(L);
+        lua_setmetatable(L, -2);
+    }
+    static H* get(void *userdata)
+    {
+        return userdata_storage<H>(static_cast<char*>(userdata) + header_size);
+    }
+private:
+    static void destroy(void *userdata)
+    {
+        get(userdata)->~H();
+    }
+};
+
+// calls a T with signature Sig with arguments from the lua stack. The per
+// signature code is only the argument extraction, everything else is
+// shared between all signatures.
+template<class T, class Sig, class Policy = checked>
+class CallHelper;
+
+template<class T, class R, class... Args, class Policy>
+class CallHelper< T, R(Args...), Policy > {
+public:
+    typedef R return_type;
+    typedef type_seq<Args...> Arguments;
+    typedef typename make_int_seq<sizeof...(Args)>::value Indices;
+
+    static_assert(count<Arguments, lua_State* >::value <= 1, "to many lua_State* arguments");
+    static_assert((count<Arguments, lua_State* >::value != 1) ||
+                (std::is_same<typename last<Arguments>::type, lua_State*>::value),
+                "lua_State* has to be last argument");
+    static_assert(varargs_last<Args...>::value, "varargs has to be last argument");
+
+    // functions taking lua_State* or varargs accept any number of arguments
+    static const bool open_arity = count<Arguments, lua_State* >::value == 1 ||
+                                   is_varargs<typename last<Arguments>::type>::value;
+
+    template<class F>
+    CallHelper(F&& f)
+    : fun(std::forward<F>(f))
+    {
+    }
+
+    R operator()(lua_State *L)
+    {
+        return exec(L, Arguments(), Indices());
+    }
+
+    template<class F>
+    static void push(lua_State *L, F&& f)
+    {
+        CallableStorage<CallHelper>::push(L, std::forward<F>(f));
+        lua_pushcclosure(L, cfunction_call, 1);
+    }
+
+    int static cfunction_call(lua_State *L)
+    {
+        int destination = ResultDestination<R>::find(L, sizeof...(Args), open_arity);
+        CallPolicy<Policy>::check_arity(L, sizeof...(Args) + (destination != 0 ? 1 : 0), open_arity);
+        CallHelper &helper = *CallableStorage<CallHelper>::get(lua_touserdata(L, lua_upvalueindex(1)));
+        return ResultDestination<R>::call(L, helper, destination);
+    }
+
+    // entry point for empty callables that are known at compile time. They
+    // are created on the fly and need no upvalue.
+    int static static_call(lua_State *L)
+    {
+        int destination = ResultDestination<R>::find(L, sizeof...(Args), open_arity);
+        CallPolicy<Policy>::check_arity(L, sizeof...(Args) + (destination != 0 ? 1 : 0), open_arity);
+        CallHelper helper((T()));
+        return ResultDestination<R>::call(L, helper, destination);
+    }
+private:
+    template<class... A, int... I>
+    R exec(lua_State *L, type_seq<A...>, int_seq<I...>)
+    {
+        return exec(L, type_seq<A...>(), int_seq<I...>(), has_userdata_rvalue<A...>());
+    }
+    template<class... A, int... I>
+    R exec(lua_State *L, type_seq<A...>, int_seq<I...>, std::false_type)
+    {
+        (void)L;
+        return fun(CallPolicy<typename argument_policy<Policy, is_member_call<T>::value && I == 0>::type>::template get<A>(L, I+1)...);
+    }
+    // braced initialization converts the arguments left to right before any
+    // rvalue argument is moved out
+    template<class... A, int... I>
+    R exec(lua_State *L, type_seq<A...>, int_seq<I...>, std::true_type)
+    {
+        std::tuple<typename CallArgument<typename argument_policy<Policy, is_member_call<T>::value && I == 0>::type, A>::type...> args{
+            CallArgument<typename argument_policy<Policy, is_member_call<T>::value && I == 0>::type, A>::get(L, I+1)...};
+        return fun(CallArgument<typename argument_policy<Policy, is_member_call<T>::value && I == 0>::type, A>::pass(L, std::get<I>(args))...);
+    }
+    T fun;
+};
+
+template<class C, class R, class... Args>
+struct mem_fun_wrap {
+    mem_fun_wrap(R (C::*fun)(Args...)) : fun(fun) { }
+    template<class... Args2>
+    R operator()(C *c, Args2&&... args) const
+    {
+        return (c->*fun)(std::forward<Args>(args)...);
+    }
+    template<class... Args2>
+    R operator()(C &c, Args2&&... args) const
+    {
+        return (c.*fun)(std::forward<Args2>(args)...);
+    }
+private:
+    R (C::*fun)(Args...);
+};
+
+template<class C, class R, class... Args>
+struct const_mem_fun_wrap {
+    const_mem_fun_wrap(R (C::*fun)(Args...) const) : fun(fun) { }
+    template<class... Args2>
+    R operator()(const C *c, Args2&&... args) const
+    {
+        return (c->*fun)(std::forward<Args2>(args)...);
+    }
+    template<class... Args2>
+    R operator()(const C &c, Args2&&... args) const
+    {
+        return (c.*fun)(std::forward<Args2>(args)...);
+    }
+private:
+    R (C::*fun)(Args...) const;
+};
+
+template<class C, class R, class... Args>
+struct is_member_call< mem_fun_wrap<C, R, Args...> > : std::true_type { };
+
+template<class C, class R, class... Args>
+struct is_member_call< const_mem_fun_wrap<C, R, Args...> > : std::true_type { };
+
+// ffi type names for the types that can be passed through the LuaJIT ffi
+// without conversion by luacpp11
+template<class T, class Enable = void>
+struct ffi_type {
+    static const bool value = false;
+};
+
+template<>
+struct ffi_type<void> {
+    static const bool value = true;
+    static std::string name() { return "void"; }
+};
+
+template<>
+struct ffi_type<bool> {
+    static const bool value = true;
+    static std::string name() { return "bool"; }
+};
+
+template<>
+struct ffi_type<char> {
+    static const bool value = true;
+    static std::string name() { return "char"; }
+};
+
+template<class T>
+struct ffi_type<T, typename std::enable_if<std::is_integral<T>::value && !std::is_const<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, char>::value>::type> {
+    static const bool value = true;
+    static std::string name()
+    {
+        return std::string(std::is_signed<T>::value ? "int" : "uint") + std::to_string(8*sizeof(T)) + "_t";
+    }
+};
+
+template<>
+struct ffi_type<float> {
+    static const bool value = true;
+    static std::string name() { return "float"; }
+};
+
+template<>
+struct ffi_type<double> {
+    static const bool value = true;
+    static std::string name() { return "double"; }
+};
+
+template<class T>
+struct ffi_type<const T, typename std::enable_if<ffi_type<T>::value>::type> {
+    static const bool value = true;
+    static std::string name() { return "const " + ffi_type<T>::name(); }
+};
+
+template<class T>
+struct ffi_type<T*, typename std::enable_if<ffi_type<T>::value>::type> {
+    static const bool value = true;
+    static std::string name() { return ffi_type<T>::name() + "*"; }
+};
+
+template<class... Args>
+struct ffi_args;
+
+template<class T, class... Rest>
+struct ffi_args<T, Rest...> {
+    static const bool value = ffi_type<T>::value && ffi_args<Rest...>::value;
+    static std::string list()
+    {
+        return sizeof...(Rest) == 0 ? ffi_type<T>::name() : ffi_type<T>::name() + ", " + ffi_args<Rest...>::list();
+    }
+};
+
+template<>
+struct ffi_args<> {
+    static const bool value = true;
+    static std::string list() { return "void"; }
+};
+
+template<class Sig>
+struct ffi_signature {
+    static const bool value = false;
+};
+
+template<class R, class... Args>
+struct ffi_signature<R(Args...)> {
+    static const bool value = ffi_type<R>::value && ffi_args<Args...>::value;
+    // the ffi returns integers wider than 32 bits as 64 bit cdata instead of
+    // numbers, so push_ffi_callable leaves those to push_callable
+    static const bool number_result = !std::is_integral<R>::value || sizeof(R) <= 4;
+    static std::string declaration(const std::string &name)
+    {
+        return ffi_type<R>::name() + " " + name + "(" + ffi_args<Args...>::list() + ")";
+    }
+};
+
+#ifdef LUAJIT_VERSION
+// replaces the light userdata on top of the stack with a ffi function
+// pointer of type decl. Returns false and pops the value if the ffi is not
+// available.
+inline bool ffi_cast(lua_State *L, const std::string &decl)
+{
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "ffi");
+    if(lua_pcall(L, 1, 1, 0) != 0 || !lua_istable(L, -1))
+    {
+        lua_pop(L, 2);
+        return false;
+    }
+    lua_getfield(L, -1, "cast");
+    lua_pushstring(L, decl.c_str());
+    lua_pushvalue(L, -4);
+    if(lua_pcall(L, 2, 1, 0) != 0)
+    {
+        lua_pop(L, 3);
+        return false;
+    }
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return true;
+}
+
+template<class Sig, bool = ffi_signature<Sig>::value && ffi_signature<Sig>::number_result>
+struct FfiHelper {
+    template<class F>
+    static bool push(lua_State *L, F f)
+    {
+        lua_pushlightuserdata(L, reinterpret_cast<void*>(f));
+        return ffi_cast(L, ffi_signature<Sig>::declaration("(*)"));
     }
 };
 
-template<class T>
-struct TupleStackHelper<T, 0> {
-    static void push(lua_State*, const T&)
+template<class Sig>
+struct FfiHelper<Sig, false> {
+    template<class F>
+    static bool push(lua_State*, F)
     {
+        return false;
     }
 };
+#endif
 
-template<class... Args>
-struct StackHelper<std::tuple<Args...>, void> {
-    static void push(lua_State *L, const std::tuple<Args...> &values)
+}
+
+template<class T, class Policy = checked, class F>
+typename std::enable_if<!detail::is_call_policy<T>::value>::type push_callable(lua_State *L, F&& f)
+{
+    detail::CallHelper< std::function<T>, T, Policy >::push(L, std::forward<F>(f));
+}
+
+template<class Policy = checked, class T>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type push_callable(lua_State *L, const std::function<T> &f)
+{
+    detail::CallHelper< std::function<T>, T, Policy >::push(L, f);
+}
+
+template<class Policy = checked, class T>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type push_callable(lua_State *L, std::function<T> &&f)
+{
+    detail::CallHelper< std::function<T>, T, Policy >::push(L, std::move(f));
+}
+
+template<class Policy = checked, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type push_callable(lua_State *L, R (*f)(Args...))
+{
+    detail::CallHelper< R(*)(Args...), R(Args...), Policy >::push(L, f);
+}
+
+template<class Policy = checked, class C, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type push_callable(lua_State *L, R (C::*f)(Args...))
+{
+    detail::CallHelper< detail::mem_fun_wrap<C, R, Args...>, R(C*, Args...), Policy >::push(L, f);
+}
+
+template<class Policy = checked, class C, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type push_callable(lua_State *L, R (C::*f)(Args...) const)
+{
+    detail::CallHelper< detail::const_mem_fun_wrap<C, R, Args...>, R(const C*, Args...), Policy >::push(L, f);
+}
+
+namespace detail {
+
+template<class Tag = void>
+struct closure_cache_counters {
+    static std::atomic<size_t> hits;
+    static std::atomic<size_t> misses;
+};
+
+template<class Tag>
+std::atomic<size_t> closure_cache_counters<Tag>::hits(0);
+
+template<class Tag>
+std::atomic<size_t> closure_cache_counters<Tag>::misses(0);
+
+// registry key of the closure cache of the CallHelper H
+template<class H>
+struct closure_cache;
+
+// function pointers are cached under light userdata, member function
+// pointers under a string of their bytes
+template<class R, class... Args>
+void push_cache_key(lua_State *L, R (*f)(Args...))
+{
+    lua_pushlightuserdata(L, reinterpret_cast<void*>(f));
+}
+
+template<class F>
+void push_cache_key(lua_State *L, const F &f)
+{
+    lua_pushlstring(L, reinterpret_cast<const char*>(&f), sizeof(F));
+}
+
+// pushes the closure of the CallHelper H for f from the closure cache of
+// the state and creates it on the first push
+template<class H, class F>
+void push_cached_callable(lua_State *L, F f)
+{
+    if(rawgetp(L, LUA_REGISTRYINDEX, type_key< closure_cache<H> >()) == LUA_TNIL)
     {
-        TupleStackHelper<std::tuple<Args...>, sizeof...(Args) >::push(L, values);
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        rawsetp(L, LUA_REGISTRYINDEX, type_key< closure_cache<H> >());
     }
-};
+    push_cache_key(L, f);
+    if(rawget(L, -2) == LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        H::push(L, f);
+        push_cache_key(L, f);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+        ++closure_cache_counters<>::misses;
+    }
+    else
+    {
+        ++closure_cache_counters<>::hits;
+    }
+    lua_replace(L, -2);
+}
 
-template<class T>
-struct return_value_count {
-    static const size_t value = 1;
+}
+
+// like push_callable, but the closure is created once per function and lua
+// state and pushed from a cache afterwards. Meant for code that pushes the
+// same function repeatedly, e.g. from an __index function.
+template<class Policy = checked, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type push_cached_callable(lua_State *L, R (*f)(Args...))
+{
+    detail::push_cached_callable< detail::CallHelper< R(*)(Args...), R(Args...), Policy > >(L, f);
+}
+
+template<class Policy = checked, class C, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type push_cached_callable(lua_State *L, R (C::*f)(Args...))
+{
+    detail::push_cached_callable< detail::CallHelper< detail::mem_fun_wrap<C, R, Args...>, R(C*, Args...), Policy > >(L, f);
+}
+
+template<class Policy = checked, class C, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type push_cached_callable(lua_State *L, R (C::*f)(Args...) const)
+{
+    detail::push_cached_callable< detail::CallHelper< detail::const_mem_fun_wrap<C, R, Args...>, R(const C*, Args...), Policy > >(L, f);
+}
+
+// returns the hits and misses of push_cached_callable in all lua states
+inline cache_stats closure_cache_stats()
+{
+    cache_stats stats;
+    stats.hits = detail::closure_cache_counters<>::hits.load();
+    stats.misses = detail::closure_cache_counters<>::misses.load();
+    return stats;
+}
+
+namespace detail {
+
+// moves the function on top of the stack into the method tables of the class
+// table below it, or into its metamethod tables if name starts with __
+inline void set_method(lua_State *L, const char *name, bool is_const)
+{
+    int first = std::strncmp(name, "__", 2) == 0 ? 5 : 1;
+    for(int slot = first; slot <= first + (is_const ? 1 : 0); ++slot)
+    {
+        lua_rawgeti(L, -2, slot);
+        lua_pushstring(L, name);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+// a function is a const method if its first argument refers to a const object
+template<class Sig>
+struct is_const_method {
+    static const bool value = false;
 };
 
-template<>
-struct return_value_count<void> {
-    static const size_t value = 0;
+template<class R, class A, class... Args>
+struct is_const_method<R(A, Args...)> {
+    typedef typename std::remove_pointer<typename std::remove_reference<A>::type>::type object_type;
+    static const bool value = std::is_const<object_type>::value;
 };
 
-template<class... Args>
-struct return_value_count< std::tuple<Args...> > {
-    static const size_t value = sizeof...(Args);
+}
+
+// add_method adds a function to the class table on top of the stack (as
+// passed to class_hook::on_register). Non const member functions and
+// functions whose first argument is a non const object are only added to the
+// method table of the non const variants. Names starting with __ add
+// metamethods to the metatables of the variants instead.
+template<class T, class Policy = checked, class F>
+typename std::enable_if<!detail::is_call_policy<T>::value>::type add_method(lua_State *L, const char *name, F&& f)
+{
+    push_callable<T, Policy>(L, std::forward<F>(f));
+    detail::set_method(L, name, detail::is_const_method<T>::value);
+}
+
+template<class Policy = checked, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type add_method(lua_State *L, const char *name, R (*f)(Args...))
+{
+    push_callable<Policy>(L, f);
+    detail::set_method(L, name, detail::is_const_method<R(Args...)>::value);
+}
+
+template<class Policy = checked, class C, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type add_method(lua_State *L, const char *name, R (C::*f)(Args...))
+{
+    push_callable<Policy>(L, f);
+    detail::set_method(L, name, false);
+}
+
+template<class Policy = checked, class C, class R, class... Args>
+typename std::enable_if<detail::is_call_policy<Policy>::value>::type add_method(lua_State *L, const char *name, R (C::*f)(Args...) const)
+{
+    push_callable<Policy>(L, f);
+    detail::set_method(L, name, true);
+}
+
+namespace detail {
+
+template<class C, class M>
+void set_field(lua_State *L, const char *name, M C::*member, bool readonly)
+{
+    member_field<C, M> *field = new (newuserdata(L, sizeof(member_field<C, M>))) member_field<C, M>();
+    field->owner = type_key<C>();
+    field->const_owner = type_key<const C>();
+    field->get = member_field<C, M>::get_member;
+    field->set = readonly ? nullptr : field_setter<C, M>::get();
+    field->member = member;
+    lua_rawgeti(L, -2, 3);
+    lua_pushstring(L, name);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+    lua_pushboolean(L, 1);
+    lua_rawseti(L, -2, 4);
+}
+
+}
+
+// add_field adds a data member to the class table on top of the stack (as
+// passed to class_hook::on_register). The field can then be read and
+// assigned from lua like a table entry, const variants and
+// add_readonly_field only allow reading.
+template<class C, class M>
+void add_field(lua_State *L, const char *name, M C::*member)
+{
+    detail::set_field(L, name, member, std::is_const<M>::value);
+}
+
+template<class C, class M>
+void add_readonly_field(lua_State *L, const char *name, M C::*member)
+{
+    detail::set_field(L, name, member, true);
+}
+
+// an entry of a module descriptor array (see push_module). Arrays end with
+// an entry whose name is null.
+struct module_entry {
+    enum kinds { function_kind, number_kind, integer_kind, string_kind, boolean_kind, table_kind };
+    const char *name;
+    int kind;
+    lua_CFunction function;
+    lua_Number number;
+    lua_Integer integer;
+    const char *string;
+    const module_entry *entries;
 };
 
+constexpr module_entry module_function(const char *name, lua_CFunction f)
+{
+    return module_entry{name, module_entry::function_kind, f, 0, 0, nullptr, nullptr};
+}
 
-template<class T, class Sig>
-class CallHelper;
+constexpr module_entry module_number(const char *name, lua_Number value)
+{
+    return module_entry{name, module_entry::number_kind, nullptr, value, 0, nullptr, nullptr};
+}
 
-template<class T, class R, class... Args>
-class CallHelper< T, R(Args...) > {
-public:
-    typedef R return_type;
-    typedef type_seq<Args...> Arguments;
-    typedef typename make_int_seq<sizeof...(Args)>::value Indices;
+constexpr module_entry module_integer(const char *name, lua_Integer value)
+{
+    return module_entry{name, module_entry::integer_kind, nullptr, 0, value, nullptr, nullptr};
+}
 
-    template<class F>
-    CallHelper(F&& f)
-    : fun(std::forward<F>(f))
+constexpr module_entry module_string(const char *name, const char *value)
+{
+    return module_entry{name, module_entry::string_kind, nullptr, 0, 0, value, nullptr};
+}
+
+constexpr module_entry module_boolean(const char *name, bool value)
+{
+    return module_entry{name, module_entry::boolean_kind, nullptr, 0, value, nullptr, nullptr};
+}
+
+// a nested module
+constexpr module_entry module_table(const char *name, const module_entry *entries)
+{
+    return module_entry{name, module_entry::table_kind, nullptr, 0, 0, nullptr, entries};
+}
+
+namespace detail {
+
+// wraps a function or member function pointer known at compile time into an
+// empty callable
+template<class F, F f>
+struct static_function;
+
+template<class R, class... Args, R (*f)(Args...)>
+struct static_function<R (*)(Args...), f> {
+    typedef R signature(Args...);
+    template<class... A>
+    R operator()(A&&... args) const
     {
+        return f(std::forward<A>(args)...);
     }
+};
 
-    R operator()(lua_State *L)
+template<class C, class R, class... Args, R (C::*f)(Args...)>
+struct static_function<R (C::*)(Args...), f> {
+    typedef R signature(C*, Args...);
+    template<class... A>
+    R operator()(C *c, A&&... args) const
     {
-        return exec(L, Arguments(), Indices());
+        return (c->*f)(std::forward<A>(args)...);
     }
+};
 
-    int static cfunction_call(lua_State *L)
+template<class C, class R, class... Args, R (C::*f)(Args...) const>
+struct static_function<R (C::*)(Args...) const, f> {
+    typedef R signature(const C*, Args...);
+    template<class... A>
+    R operator()(const C *c, A&&... args) const
     {
-        static_assert(count<Arguments, lua_State* >::value <= 1, "to many lua_State* arguments");
-        static_assert((count<Arguments, lua_State* >::value != 1) ||
-                    (std::is_same<typename last<Arguments>::type, lua_State*>::value),
-                    "lua_State* has to be last argument");
+        return (c->*f)(std::forward<A>(args)...);
+    }
+};
 
-        if(count<Arguments, lua_State* >::value == 0)
-        {
-            if(lua_gettop(L) != sizeof...(Args))
-            {
-                lua_pushfstring(L, "expected %d arguments but got %d", sizeof...(Args), lua_gettop(L));
-                lua_error(L);
-            }
-        }
-        else if(count<Arguments, lua_State* >::value == 1)
+template<class C, class R, class... Args, R (C::*f)(Args...)>
+struct is_member_call< static_function<R (C::*)(Args...), f> > : std::true_type { };
+
+template<class C, class R, class... Args, R (C::*f)(Args...) const>
+struct is_member_call< static_function<R (C::*)(Args...) const, f> > : std::true_type { };
+
+// the lua_CFunction calling f
+template<class F, F f, class Policy = checked>
+struct Trampoline {
+    typedef static_function<F, f> function_type;
+    static int call(lua_State *L)
+    {
+        return CallHelper<function_type, typename function_type::signature, Policy>::static_call(L);
+    }
+};
+
+// the C++ operators behind operator_metamethods
+struct add_operator {
+    static const char* symbol() { return "+"; }
+    template<class A, class B>
+    static auto apply(const A &a, const B &b) -> decltype(a + b) { return a + b; }
+};
+
+struct sub_operator {
+    static const char* symbol() { return "-"; }
+    template<class A, class B>
+    static auto apply(const A &a, const B &b) -> decltype(a - b) { return a - b; }
+};
+
+struct mul_operator {
+    static const char* symbol() { return "*"; }
+    template<class A, class B>
+    static auto apply(const A &a, const B &b) -> decltype(a * b) { return a * b; }
+};
+
+struct div_operator {
+    static const char* symbol() { return "/"; }
+    template<class A, class B>
+    static auto apply(const A &a, const B &b) -> decltype(a / b) { return a / b; }
+};
+
+struct eq_operator {
+    static const char* symbol() { return "=="; }
+    template<class A, class B>
+    static auto apply(const A &a, const B &b) -> decltype(a == b) { return a == b; }
+};
+
+struct lt_operator {
+    static const char* symbol() { return "<"; }
+    template<class A, class B>
+    static auto apply(const A &a, const B &b) -> decltype(a < b) { return a < b; }
+};
+
+struct le_operator {
+    static const char* symbol() { return "<="; }
+    template<class A, class B>
+    static auto apply(const A &a, const B &b) -> decltype(a <= b) { return a <= b; }
+};
+
+struct unm_operator {
+    static const char* symbol() { return "-"; }
+    template<class A>
+    static auto apply(const A &a) -> decltype(-a) { return -a; }
+};
+
+template<class Op, class A, class B>
+struct has_binary_operator {
+    template<class O>
+    static char test(typename std::decay<decltype(O::apply(std::declval<const A&>(), std::declval<const B&>()))>::type*);
+    template<class O>
+    static long test(...);
+    static const bool value = sizeof(test<Op>(0)) == 1;
+};
+
+template<class Op, class A>
+struct has_unary_operator {
+    template<class O>
+    static char test(typename std::decay<decltype(O::apply(std::declval<const A&>()))>::type*);
+    template<class O>
+    static long test(...);
+    static const bool value = sizeof(test<Op>(0)) == 1;
+};
+
+template<class T>
+struct has_call_operator {
+    template<class U>
+    static char test(decltype(&U::operator()));
+    template<class U>
+    static long test(...);
+    static const bool value = sizeof(test<T>(0)) == 1;
+};
+
+// pushes the result of Op applied to a and b and returns true if the
+// operands support it
+template<class Op, class A, class B>
+typename std::enable_if<has_binary_operator<Op, A, B>::value, bool>::type apply_operator(lua_State *L, const A &a, const B &b)
+{
+    typedef typename std::decay<decltype(Op::apply(a, b))>::type result_type;
+    StackHelper<result_type>::push(L, Op::apply(a, b));
+    return true;
+}
+
+template<class Op, class A, class B>
+typename std::enable_if<!has_binary_operator<Op, A, B>::value, bool>::type apply_operator(lua_State*, const A&, const B&)
+{
+    return false;
+}
+
+inline int operator_error(lua_State *L, const char *symbol)
+{
+    lua_pushfstring(L, "attempt to apply %s to a %s and a %s", symbol, lua_typename(L, lua_type(L, 1)), lua_typename(L, lua_type(L, 2)));
+    return lua_error(L);
+}
+
+// metamethod for a binary operator. Operands are objects convertible to
+// const T& or numbers.
+template<class T, class Op>
+int binary_metamethod(lua_State *L)
+{
+    const T *a = getPointer<const T>(L, 1);
+    const T *b = getPointer<const T>(L, 2);
+    bool done = false;
+    if(a != nullptr && b != nullptr)
+        done = apply_operator<Op>(L, *a, *b);
+    else if(a != nullptr && lua_type(L, 2) == LUA_TNUMBER)
+        done = apply_operator<Op>(L, *a, static_cast<double>(lua_tonumber(L, 2)));
+    else if(b != nullptr && lua_type(L, 1) == LUA_TNUMBER)
+        done = apply_operator<Op>(L, static_cast<double>(lua_tonumber(L, 1)), *b);
+    if(!done)
+        return operator_error(L, Op::symbol());
+    return 1;
+}
+
+// objects that can't be compared are not equal
+template<class T>
+int eq_metamethod(lua_State *L)
+{
+    const T *a = getPointer<const T>(L, 1);
+    const T *b = getPointer<const T>(L, 2);
+    if(a == nullptr || b == nullptr || !apply_operator<eq_operator>(L, *a, *b))
+        lua_pushboolean(L, 0);
+    return 1;
+}
+
+template<class T>
+int unm_metamethod(lua_State *L)
+{
+    const T *a = getPointer<const T>(L, 1);
+    if(a == nullptr)
+        return operator_error(L, unm_operator::symbol());
+    typedef typename std::decay<decltype(unm_operator::apply(*a))>::type result_type;
+    StackHelper<result_type>::push(L, unm_operator::apply(*a));
+    return 1;
+}
+
+template<class T>
+struct Operators<T, true> {
+    // the functions are created once per state and shared by all variants
+    // since lua 5.1 only compares objects with the same __eq, __lt and __le
+    static void add(lua_State *L)
+    {
+        if(rawgetp(L, LUA_REGISTRYINDEX, type_key<Operators>()) == LUA_TNIL)
         {
-            if(lua_gettop(L) < sizeof...(Args)-1)
-            {
-                lua_pushfstring(L, "expected at least %d arguments but got %d", sizeof...(Args), lua_gettop(L));
-                lua_error(L);
-            }
+            lua_pop(L, 1);
+            lua_newtable(L);
+            set<add_operator>(L, "__add");
+            set<sub_operator>(L, "__sub");
+            set<mul_operator>(L, "__mul");
+            set<div_operator>(L, "__div");
+            set<lt_operator>(L, "__lt");
+            set<le_operator>(L, "__le");
+            set_metamethod(L, "__eq", has_binary_operator<eq_operator, T, T>::value ? eq_metamethod<T> : nullptr);
+            set_unm(L, std::integral_constant<bool, has_unary_operator<unm_operator, T>::value>());
+            set_call(L, std::integral_constant<bool, has_call_operator<T>::value>());
+            lua_pushvalue(L, -1);
+            rawsetp(L, LUA_REGISTRYINDEX, type_key<Operators>());
         }
-
-        CallHelper &helper = *static_cast <CallHelper*> (lua_touserdata (L, lua_upvalueindex (1)));
-        StackHelper<R>::push(L, helper(L));
-        return return_value_count<R>::value;
+        copy_metamethods(L, -1, -2);
+        lua_pop(L, 1);
     }
 private:
-    template<class... A, int... I>
-    R exec(lua_State *L, type_seq<A...>, int_seq<I...>)
+    // the operator is used with two objects or an object and a number
+    template<class Op>
+    static void set(lua_State *L, const char *name)
     {
-        return fun(StackHelper<A>::template get<I+1>(L)...);
+        const bool supported = has_binary_operator<Op, T, T>::value ||
+                               has_binary_operator<Op, T, double>::value ||
+                               has_binary_operator<Op, double, T>::value;
+        set_metamethod(L, name, supported ? binary_metamethod<T, Op> : nullptr);
+    }
+    static void set_unm(lua_State *L, std::true_type)
+    {
+        set_metamethod(L, "__unm", unm_metamethod<T>);
+    }
+    static void set_unm(lua_State*, std::false_type)
+    {
+    }
+    static void set_call(lua_State *L, std::true_type)
+    {
+        typedef decltype(&T::operator()) F;
+        set_metamethod(L, "__call", Trampoline<F, &T::operator()>::call);
+    }
+    static void set_call(lua_State*, std::false_type)
+    {
+    }
+    static void set_metamethod(lua_State *L, const char *name, lua_CFunction f)
+    {
+        if(f == nullptr)
+            return;
+        lua_pushstring(L, name);
+        lua_pushcfunction(L, f);
+        lua_rawset(L, -3);
     }
-    T fun;
 };
 
-template<class T, class... Args>
-class CallHelper< T, void(Args...) > {
-public:
-    typedef void return_type;
-    typedef type_seq<Args...> Arguments;
-    typedef typename make_int_seq<sizeof...(Args)>::value Indices;
+// iteration state of push_range. It is stored like a callable, so iterators
+// that need destruction get the shared callable finalizer.
+template<class It>
+struct RangeState {
+    RangeState(It first, It last) : current(first), last(last), index(0) { }
+    It current;
+    It last;
+    lua_Integer index;
+};
 
-    template<class F>
-    CallHelper(F&& f)
-    : fun(std::forward<F>(f))
+// pushes the loop variables of an element: index and element, or key and
+// value for std::pair elements as found in maps
+template<class E>
+struct RangeElement {
+    static int push(lua_State *L, lua_Integer index, const E &element)
     {
+        lua_pushinteger(L, index);
+        StackHelper<E>::push(L, element);
+        return 2;
     }
+};
 
-    void operator()(lua_State *L)
+template<class K, class V>
+struct RangeElement< std::pair<K, V> > {
+    static int push(lua_State *L, lua_Integer, const std::pair<K, V> &element)
     {
-        exec(L, Arguments(), Indices());
+        StackHelper<typename std::remove_const<K>::type>::push(L, element.first);
+        StackHelper<V>::push(L, element.second);
+        return 2;
     }
+};
 
-    int static cfunction_call(lua_State *L)
-    {
-        static_assert(count<Arguments, lua_State* >::value <= 1, "to many lua_State* arguments");
-        static_assert((count<Arguments, lua_State* >::value != 1) ||
-                    (std::is_same<typename last<Arguments>::type, lua_State*>::value),
-                    "lua_State* has to be last argument");
+template<class It>
+int range_next(lua_State *L)
+{
+    RangeState<It> &state = *CallableStorage< RangeState<It> >::get(lua_touserdata(L, lua_upvalueindex(1)));
+    if(state.current == state.last)
+        return 0;
+    ++state.index;
+    int results = RangeElement<typename std::iterator_traits<It>::value_type>::push(L, state.index, *state.current);
+    ++state.current;
+    return results;
+}
 
-        if(count<Arguments, lua_State* >::value == 0)
-        {
-            if(lua_gettop(L) != sizeof...(Args))
-            {
-                lua_pushfstring(L, "expected %d arguments but got %d", sizeof...(Args), lua_gettop(L));
-                lua_error(L);
-            }
-        }
-        else if(count<Arguments, lua_State* >::value == 1)
-        {
-            if(lua_gettop(L) < sizeof...(Args)-1)
-            {
-                lua_pushfstring(L, "expected at least %d arguments but got %d", sizeof...(Args), lua_gettop(L));
-                lua_error(L);
-            }
-        }
+// keep is the index of a value the iterator function holds as second
+// upvalue to keep it alive, e.g. the container, or 0
+template<class It>
+void push_range(lua_State *L, It first, It last, int keep = 0)
+{
+    if(keep != 0)
+        keep = absindex(L, keep);
+    CallableStorage< RangeState<It> >::push(L, RangeState<It>(first, last));
+    if(keep == 0)
+    {
+        lua_pushcclosure(L, range_next<It>, 1);
+        return;
+    }
+    lua_pushvalue(L, keep);
+    lua_pushcclosure(L, range_next<It>, 2);
+}
 
-        CallHelper &helper = *static_cast <CallHelper*> (lua_touserdata (L, lua_upvalueindex (1)));
-        helper(L);
-        return 0;
+// returns the iterator function, which keeps the container alive, the
+// container as state and nil as initial control value
+template<class C>
+int pairs_metamethod(lua_State *L)
+{
+    const C *container = getPointer<const C>(L, 1);
+    if(container == nullptr)
+        return argument_error(L, 1, "userdata");
+    push_range(L, container->begin(), container->end(), 1);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+template<class T>
+struct is_pair : std::false_type { };
+
+template<class K, class V>
+struct is_pair< std::pair<K, V> > : std::true_type { };
+
+template<class T>
+struct Ranges<T, true> {
+    typedef typename std::iterator_traits<decltype(std::declval<const T&>().begin())>::value_type element_type;
+
+    static void add(lua_State *L)
+    {
+        lua_pushliteral(L, "__pairs");
+        lua_pushcfunction(L, pairs_metamethod<T>);
+        lua_rawset(L, -3);
+        add_ipairs(L, std::integral_constant<bool, !is_pair<element_type>::value>());
     }
 private:
-    template<class... A, int... I>
-    void exec(lua_State *L, type_seq<A...>, int_seq<I...>)
+    // ipairs yields index and element, which pairs does too unless the
+    // elements are key value pairs. Lua 5.4 ignores __ipairs.
+    static void add_ipairs(lua_State *L, std::true_type)
+    {
+#if LUA_VERSION_NUM < 504
+        lua_pushliteral(L, "__ipairs");
+        lua_pushcfunction(L, pairs_metamethod<T>);
+        lua_rawset(L, -3);
+#else
+        (void)L;
+#endif
+    }
+    static void add_ipairs(lua_State*, std::false_type)
     {
-        return fun(StackHelper<A>::template get<I+1>(L)...);
     }
-    T fun;
 };
 
-template<class T, class... Args>
-class CallHelper< T, luareturn(Args...) > {
-public:
-    typedef luareturn return_type;
-    typedef type_seq<Args...> Arguments;
-    typedef typename make_int_seq<sizeof...(Args)>::value Indices;
+inline size_t module_name_hash(const char *name)
+{
+    size_t hash = 2166136261u;
+    for(; *name != 0; ++name)
+        hash = (hash ^ static_cast<unsigned char>(*name))*16777619u;
+    return hash;
+}
 
-    template<class F>
-    CallHelper(F&& f)
-    : fun(std::forward<F>(f))
+// pushes a userdata with the name index of a descriptor array. It is an open
+// addressing hash table of entry positions + 1 whose first element is its
+// size. The first of several entries with the same name wins.
+inline void push_module_names(lua_State *L, const module_entry *entries)
+{
+    size_t count = 0;
+    while(entries[count].name != nullptr)
+        ++count;
+    size_t size = 1;
+    while(size < 2*count)
+        size *= 2;
+    uint32_t *slots = static_cast<uint32_t*>(newuserdata(L, (size + 1)*sizeof(uint32_t)));
+    slots[0] = static_cast<uint32_t>(size);
+    std::fill(slots + 1, slots + size + 1, 0);
+    for(size_t i = 0; i < count; ++i)
     {
+        size_t slot = module_name_hash(entries[i].name) & (size - 1);
+        while(slots[slot + 1] != 0 && std::strcmp(entries[slots[slot + 1] - 1].name, entries[i].name) != 0)
+            slot = (slot + 1) & (size - 1);
+        if(slots[slot + 1] == 0)
+            slots[slot + 1] = static_cast<uint32_t>(i + 1);
     }
+}
 
-    int operator()(lua_State *L)
+// finds the entry called name with the index of push_module_names
+inline const module_entry* find_module_entry(const module_entry *entries, const uint32_t *slots, const char *name)
+{
+    size_t size = slots[0];
+    for(size_t slot = module_name_hash(name) & (size - 1); slots[slot + 1] != 0; slot = (slot + 1) & (size - 1))
     {
-        return exec(L, Arguments(), Indices());
+        const module_entry *entry = &entries[slots[slot + 1] - 1];
+        if(std::strcmp(entry->name, name) == 0)
+            return entry;
     }
+    return nullptr;
+}
 
-    int static cfunction_call(lua_State *L)
-    {
-        static_assert(count<Arguments, lua_State* >::value <= 1, "to many lua_State* arguments");
-        static_assert((count<Arguments, lua_State* >::value != 1) ||
-                    (std::is_same<typename last<Arguments>::type, lua_State*>::value),
-                    "lua_State* has to be last argument");
-
-        if(count<Arguments, lua_State* >::value == 0)
-        {
-            if(lua_gettop(L) != sizeof...(Args))
-            {
-                lua_pushfstring(L, "expected %d arguments but got %d", sizeof...(Args), lua_gettop(L));
-                lua_error(L);
-            }
-        }
-        else if(count<Arguments, lua_State* >::value == 1)
-        {
-            if(lua_gettop(L) < sizeof...(Args)-1)
-            {
-                lua_pushfstring(L, "expected at least %d arguments but got %d", sizeof...(Args), lua_gettop(L));
-                lua_error(L);
-            }
-        }
+inline void push_module(lua_State *L, const module_entry *entries, bool lazy);
 
-        CallHelper &helper = *static_cast <CallHelper*> (lua_touserdata (L, lua_upvalueindex (1)));
-        return helper(L);
-    }
-private:
-    template<class... A, int... I>
-    int exec(lua_State *L, type_seq<A...>, int_seq<I...>)
+inline void push_module_value(lua_State *L, const module_entry &entry, bool lazy)
+{
+    switch(entry.kind)
     {
-        return fun(StackHelper<A>::template get<I+1>(L)...).count;
+    case module_entry::function_kind:
+        lua_pushcfunction(L, entry.function);
+        break;
+    case module_entry::number_kind:
+        lua_pushnumber(L, entry.number);
+        break;
+    case module_entry::integer_kind:
+        lua_pushinteger(L, entry.integer);
+        break;
+    case module_entry::string_kind:
+        lua_pushstring(L, entry.string);
+        break;
+    case module_entry::boolean_kind:
+        lua_pushboolean(L, entry.integer != 0);
+        break;
+    default:
+        push_module(L, entry.entries, lazy);
     }
-    T fun;
-};
+}
 
-template<class C, class R, class... Args>
-struct mem_fun_wrap {
-    mem_fun_wrap(R (C::*fun)(Args...)) : fun(fun) { }
-    template<class... Args2>
-    R operator()(C *c, Args2&&... args) const
-    {
-        return (c->*fun)(std::forward<Args>(args)...);
-    }
-    template<class... Args2>
-    R operator()(C &c, Args2&&... args) const
+// __index of lazy modules, binds the entry and stores it in the module table.
+// The name index is the second upvalue and is built on first use, so it
+// belongs to the module table and goes away with it.
+inline int lazy_module_index(lua_State *L)
+{
+    if(lua_type(L, 2) != LUA_TSTRING)
+        return 0;
+    size_t length;
+    const char *name = lua_tolstring(L, 2, &length);
+    if(std::strlen(name) != length)
+        return 0;
+    const module_entry *entries = static_cast<const module_entry*>(lua_touserdata(L, lua_upvalueindex(1)));
+    if(lua_isnil(L, lua_upvalueindex(2)))
     {
-        return (c.*fun)(std::forward<Args2>(args)...);
+        push_module_names(L, entries);
+        lua_replace(L, lua_upvalueindex(2));
     }
-private:
-    R (C::*fun)(Args...);
-};
+    const uint32_t *slots = static_cast<const uint32_t*>(lua_touserdata(L, lua_upvalueindex(2)));
+    const module_entry *entry = find_module_entry(entries, slots, name);
+    if(entry == nullptr)
+        return 0;
+    push_module_value(L, *entry, true);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+    return 1;
+}
 
-template<class C, class R, class... Args>
-struct const_mem_fun_wrap {
-    const_mem_fun_wrap(R (C::*fun)(Args...) const) : fun(fun) { }
-    template<class... Args2>
-    R operator()(const C *c, Args2&&... args) const
+inline void push_module(lua_State *L, const module_entry *entries, bool lazy)
+{
+    if(lazy)
     {
-        return (c->*fun)(std::forward<Args2>(args)...);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "__index");
+        lua_pushlightuserdata(L, const_cast<module_entry*>(entries));
+        lua_pushnil(L);
+        lua_pushcclosure(L, lazy_module_index, 2);
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
+        return;
     }
-    template<class... Args2>
-    R operator()(const C &c, Args2&&... args) const
+    int count = 0;
+    while(entries[count].name != nullptr)
+        ++count;
+    lua_createtable(L, 0, count);
+    for(int i = 0; i < count; ++i)
     {
-        return (c.*fun)(std::forward<Args2>(args)...);
+        lua_pushstring(L, entries[i].name);
+        push_module_value(L, entries[i], false);
+        lua_rawset(L, -3);
     }
-private:
-    R (C::*fun)(Args...) const;
-};
+}
 
 }
 
-template<class T, class F>
-void push_callable(lua_State *L, F&& f)
+// the module_entry of a function or member function pointer. The pointer is
+// a template argument of the generated lua_CFunction, so the closure needs
+// no upvalue.
+#define LUACPP11_FUNCTION(name, f) \
+    ::luacpp11::module_function(name, &::luacpp11::detail::Trampoline<typename std::decay<decltype(f)>::type, f>::call)
+
+// pushes a table with the entries of the descriptor array into a table
+// sized for all of them
+inline void push_module(lua_State *L, const module_entry *entries)
 {
-    detail::StackHelper< detail::CallHelper< std::function<T>, T > >::emplace(L, std::forward<F>(f));
-    lua_pushcclosure (L, detail::CallHelper< std::function<T>, T >::cfunction_call, 1);
+    detail::push_module(L, entries, false);
 }
 
-template<class T>
-void push_callable(lua_State *L, const std::function<T> &f)
+// pushes an empty table whose __index binds entries on first access and
+// stores them in the table. Nested modules are lazy as well.
+inline void push_lazy_module(lua_State *L, const module_entry *entries)
 {
-    detail::StackHelper< detail::CallHelper< std::function<T>, T > >::emplace(L, f);
-    lua_pushcclosure (L, detail::CallHelper< std::function<T>, T >::cfunction_call, 1);
+    detail::push_module(L, entries, true);
 }
 
+// returns the C declaration of a function with signature T suitable for
+// ffi.cdef, for example "double name(double, int32_t)"
 template<class T>
-void push_callable(lua_State *L, std::function<T> &&f)
+std::string ffi_declaration(const std::string &name)
 {
-    detail::StackHelper< detail::CallHelper< std::function<T>, T > >::emplace(L, std::move(f));
-    lua_pushcclosure (L, detail::CallHelper< std::function<T>, T >::cfunction_call, 1);
+    static_assert(detail::ffi_signature<T>::value, "signature can not be expressed in the ffi");
+    return detail::ffi_signature<T>::declaration(name);
 }
 
+// under LuaJIT pushes functions whose signature only contains arithmetic
+// types and pointers to them as ffi function pointer so calls from lua can
+// be compiled by the JIT. Functions returning integers wider than 32 bits,
+// everything else and other lua versions fall back to push_callable.
 template<class R, class... Args>
-void push_callable(lua_State *L, R (*f)(Args...))
-{
-    detail::StackHelper< detail::CallHelper< R(*)(Args...), R(Args...) > >::emplace(L, f);
-    lua_pushcclosure (L, detail::CallHelper< R(*)(Args...), R(Args...) >::cfunction_call, 1);
-}
-
-template<class C, class R, class... Args>
-void push_callable(lua_State *L, R (C::*f)(Args...))
+void push_ffi_callable(lua_State *L, R (*f)(Args...))
 {
-    detail::StackHelper< detail::CallHelper< detail::mem_fun_wrap<C, R, Args...>, R(C*, Args...) > >::emplace(L, f);
-    lua_pushcclosure (L, detail::CallHelper< detail::mem_fun_wrap<C, R, Args...>, R(C*, Args...) >::cfunction_call, 1);
+#ifdef LUAJIT_VERSION
+    if(detail::FfiHelper<R(Args...)>::push(L, f))
+        return;
+#endif
+    push_callable(L, f);
 }
 
-template<class C, class R, class... Args>
-void push_callable(lua_State *L, R (C::*f)(Args...) const)
+// pushes an iterator function for a generic for over [first, last). The
+// loop variables are the index and the element, or key and value for ranges
+// of std::pair. Elements are converted when the loop reaches them, so
+// breaking out early skips the rest. The range has to stay valid as long as
+// the function is used.
+template<class It>
+void push_range(lua_State *L, It first, It last)
 {
-    detail::StackHelper< detail::CallHelper< detail::const_mem_fun_wrap<C, R, Args...>, R(const C*, Args...) > >::emplace(L, f);
-    lua_pushcclosure (L, detail::CallHelper< detail::const_mem_fun_wrap<C, R, Args...>, R(const C*, Args...) >::cfunction_call, 1);
+    detail::push_range(L, first, last);
 }
 
 template<class T>
@@ -972,6 +4649,43 @@ void getmetatable(lua_State *L)
     detail::StackHelper<T>::getmetatable(L);
 }
 
+// destroys up to max_objects of the objects with deferred_destruction that
+// were collected in the state of L and returns how many were destroyed
+inline size_t destroy_deferred(lua_State *L, size_t max_objects = size_t(-1))
+{
+    detail::destruction_queue *queue = detail::state_destruction_queue(L, false);
+    return queue != nullptr ? queue->drain(max_objects) : 0;
+}
+
+inline destruction_stats deferred_stats(lua_State *L)
+{
+    detail::destruction_queue *queue = detail::state_destruction_queue(L, false);
+    return queue != nullptr ? queue->stats : detail::destruction_queue().stats;
+}
+
+inline destruction_stats background_stats()
+{
+    return detail::background_destroyer::instance().stats();
+}
+
+// destroys the objects still pending with background_destruction and stops
+// the destroying thread. Objects collected later are destroyed in __gc.
+// Call it while everything their destructors use is still alive, e.g. at
+// the end of main.
+inline void stop_background_destruction()
+{
+    detail::background_destroyer::instance().shutdown();
+}
+
+// returns the number of live objects of type T held by value or unique_ptr
+// in any lua state and the external memory they reported (see memory_size).
+template<class T>
+std::tuple<size_t, size_t> memory_stats()
+{
+    return std::make_tuple(detail::memory_counters<T>::objects.load(),
+                           detail::memory_counters<T>::bytes.load());
+}
+
 inline lua_State* newthread(lua_State *L)
 {
     lua_State *L2 = lua_newthread(L);
@@ -979,5 +4693,455 @@ inline lua_State* newthread(lua_State *L)
     return L2;
 }
 
+namespace detail {
+struct BudgetScope;
+}
+
+// limits the execution of a call started with pcall or resume. Zero means
+// no limit. The limits are checked by a count hook every granularity
+// instructions and apply to each call separately.
+class budget {
+public:
+    static const int granularity = 1000;
+
+    explicit budget(unsigned long instructions, std::chrono::nanoseconds time = std::chrono::nanoseconds::zero())
+    : instructions(instructions), time(time), used(0), hit(false), thread(nullptr)
+    {
+    }
+
+    // whether the last call ran out of budget
+    bool exceeded() const { return hit; }
+    // the instructions the last call executed, counted in hook intervals
+    unsigned long executed() const { return used; }
+private:
+    friend struct detail::BudgetScope;
+
+    unsigned long instructions;
+    std::chrono::nanoseconds time;
+    std::chrono::steady_clock::time_point deadline;
+    unsigned long used;
+    bool hit;
+    lua_State *thread;
+};
+
+namespace detail {
+
+// makes a budget the active one of the lua state and installs the count
+// hook for its lifetime. The previous budget and hook are restored
+// afterwards, so budgets nest. Threads created while the hook is installed
+// inherit it and are charged to the active budget.
+#ifdef LUAJIT_VERSION
+// true if the JIT compiler is on. The C API can't query the engine mode, so
+// this asks jit.status if the jit library is loaded and assumes the default
+// otherwise.
+inline bool jit_enabled(lua_State *L)
+{
+    int top = lua_gettop(L);
+    bool enabled = true;
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    if(lua_istable(L, -1))
+    {
+        lua_getfield(L, -1, "jit");
+        if(lua_istable(L, -1))
+        {
+            lua_getfield(L, -1, "status");
+            if(lua_isfunction(L, -1) && lua_pcall(L, 0, 1, 0) == 0)
+                enabled = lua_toboolean(L, -1) != 0;
+        }
+    }
+    lua_settop(L, top);
+    return enabled;
+}
+#endif
+
+struct BudgetScope {
+    BudgetScope(lua_State *L, budget &b, bool yield)
+    : L(L), hook(lua_gethook(L)), mask(lua_gethookmask(L)), count(lua_gethookcount(L)), jit(false)
+    {
+        rawgetp(L, LUA_REGISTRYINDEX, type_key<budget>());
+        previous = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        b.used = 0;
+        b.hit = false;
+        b.deadline = std::chrono::steady_clock::now() + b.time;
+        b.thread = yield ? L : nullptr;
+        lua_pushlightuserdata(L, &b);
+        rawsetp(L, LUA_REGISTRYINDEX, type_key<budget>());
+        int interval = budget::granularity;
+        if(b.instructions != 0 && b.instructions < static_cast<unsigned long>(interval))
+            interval = static_cast<int>(b.instructions);
+        lua_sethook(L, budget_hook, LUA_MASKCOUNT, interval);
+#ifdef LUAJIT_VERSION
+        // compiled code does not call hooks, so the outermost budget runs
+        // its call interpreted. Nested budgets find the JIT off already.
+        if(previous == nullptr)
+        {
+            jit = jit_enabled(L);
+            luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_FLUSH);
+            luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+        }
+#endif
+    }
+    ~BudgetScope()
+    {
+#ifdef LUAJIT_VERSION
+        if(previous == nullptr && jit)
+            luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_ON);
+#endif
+        if(previous != nullptr)
+            lua_pushlightuserdata(L, previous);
+        else
+            lua_pushnil(L);
+        rawsetp(L, LUA_REGISTRYINDEX, type_key<budget>());
+        lua_sethook(L, hook, mask, count);
+    }
+
+    static void budget_hook(lua_State *L, lua_Debug*)
+    {
+        rawgetp(L, LUA_REGISTRYINDEX, type_key<budget>());
+        budget *b = static_cast<budget*>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        if(b == nullptr)
+        {
+            // a thread that inherited the hook after the budget ended
+            lua_sethook(L, nullptr, 0, 0);
+            return;
+        }
+        b->used += lua_gethookcount(L);
+        if(!b->hit)
+        {
+            b->hit = (b->instructions != 0 && b->used >= b->instructions) ||
+                     (b->time.count() != 0 && std::chrono::steady_clock::now() >= b->deadline);
+            if(!b->hit)
+                return;
+        }
+#if LUA_VERSION_NUM >= 503
+        if(L == b->thread && lua_isyieldable(L))
+#else
+        if(L == b->thread)
+#endif
+        {
+            lua_yield(L, 0);
+            return;
+        }
+        lua_pushstring(L, "execution budget exceeded");
+        lua_error(L);
+    }
+
+    lua_State *L;
+    lua_Hook hook;
+    int mask;
+    int count;
+    void *previous;
+    // the JIT was on before the outermost budget
+    bool jit;
+};
+
+}
+
+// lua_pcall with an execution budget. A call that exceeds it fails with the
+// error "execution budget exceeded". Scripts that catch the error get it
+// again at the next hook.
+inline int pcall(lua_State *L, int nargs, int nresults, int msgh, budget &b)
+{
+    detail::BudgetScope scope(L, b, false);
+    return lua_pcall(L, nargs, nresults, msgh);
+}
+
+// resumes thread with an execution budget. A thread that exceeds it yields
+// without values and can be resumed again with nargs 0. Threads that can
+// not yield at that point fail like in pcall. Returns the status of
+// lua_resume, nresults receives the number of values on the thread stack.
+inline int resume(lua_State *thread, lua_State *from, int nargs, budget &b, int *nresults)
+{
+    detail::BudgetScope scope(thread, b, true);
+    return detail::resume(thread, from, nargs, nresults);
+}
+
+// buffers get their methods and __len from a class_hook
+template<>
+struct class_hook<buffer> {
+    static void on_register(lua_State *L);
+};
+
+namespace detail {
+
+// a format of buffer:read and buffer:write. Formats are i, u or f followed
+// by the number of bits and optionally le or be, e.g. "u32" or "i16be".
+// Byte order defaults to little endian.
+struct buffer_format {
+    char kind;
+    size_t size;
+    endian order;
+};
+
+inline bool parse_buffer_format(const char *text, buffer_format &format)
+{
+    if(text[0] == 0)
+        return false;
+    format.kind = text[0];
+    size_t bits = 0;
+    const char *rest = text + 1;
+    while(*rest >= '0' && *rest <= '9' && bits < 128)
+        bits = bits*10 + (*rest++ - '0');
+    format.size = bits/8;
+    if(*rest == 0 || std::strcmp(rest, "le") == 0)
+        format.order = endian::little;
+    else if(std::strcmp(rest, "be") == 0)
+        format.order = endian::big;
+    else
+        return false;
+    if(format.kind == 'f')
+        return bits == 32 || bits == 64;
+    return (format.kind == 'i' || format.kind == 'u') && (bits == 8 || bits == 16 || bits == 32 || bits == 64);
+}
+
+inline buffer_format check_buffer_format(lua_State *L, int index)
+{
+    buffer_format format;
+    if(!parse_buffer_format(luaL_checkstring(L, index), format))
+        luaL_argerror(L, index, "invalid buffer format");
+    return format;
+}
+
+// the offset at index, raises an error unless size bytes at it are inside
+// the buffer
+inline size_t check_buffer_offset(lua_State *L, const buffer &self, int index, size_t size)
+{
+    lua_Integer offset = luaL_checkinteger(L, index);
+    if(offset < 0 || static_cast<size_t>(offset) > self.size() || size > self.size() - static_cast<size_t>(offset))
+        luaL_error(L, "buffer access out of range");
+    return static_cast<size_t>(offset);
+}
+
+template<class S, class U>
+lua_Integer read_buffer_integer(const buffer &self, size_t offset, const buffer_format &format)
+{
+    if(format.kind == 'i')
+        return static_cast<lua_Integer>(self.read<S>(offset, format.order));
+    return static_cast<lua_Integer>(self.read<U>(offset, format.order));
+}
+
+// buffer:read(format, offset)
+inline luareturn buffer_read(const buffer &self, lua_State *L)
+{
+    buffer_format format = check_buffer_format(L, 2);
+    size_t offset = check_buffer_offset(L, self, 3, format.size);
+    if(format.kind == 'f')
+    {
+        if(format.size == 4)
+            lua_pushnumber(L, self.read<float>(offset, format.order));
+        else
+            lua_pushnumber(L, self.read<double>(offset, format.order));
+        return luareturn(1);
+    }
+    switch(format.size)
+    {
+    case 1: lua_pushinteger(L, read_buffer_integer<int8_t, uint8_t>(self, offset, format)); break;
+    case 2: lua_pushinteger(L, read_buffer_integer<int16_t, uint16_t>(self, offset, format)); break;
+    case 4: lua_pushinteger(L, read_buffer_integer<int32_t, uint32_t>(self, offset, format)); break;
+    default: lua_pushinteger(L, read_buffer_integer<int64_t, uint64_t>(self, offset, format)); break;
+    }
+    return luareturn(1);
+}
+
+// buffer:write(format, offset, value)
+inline luareturn buffer_write(buffer &self, lua_State *L)
+{
+    buffer_format format = check_buffer_format(L, 2);
+    size_t offset = check_buffer_offset(L, self, 3, format.size);
+    if(format.kind == 'f')
+    {
+        lua_Number value = luaL_checknumber(L, 4);
+        if(format.size == 4)
+            self.write<float>(offset, static_cast<float>(value), format.order);
+        else
+            self.write<double>(offset, value, format.order);
+        return luareturn(0);
+    }
+    // integers are written as their two's complement in the given size
+    uint64_t value = static_cast<uint64_t>(luaL_checkinteger(L, 4));
+    switch(format.size)
+    {
+    case 1: self.write<uint8_t>(offset, static_cast<uint8_t>(value), format.order); break;
+    case 2: self.write<uint16_t>(offset, static_cast<uint16_t>(value), format.order); break;
+    case 4: self.write<uint32_t>(offset, static_cast<uint32_t>(value), format.order); break;
+    default: self.write<uint64_t>(offset, value, format.order); break;
+    }
+    return luareturn(0);
+}
+
+// the bytes of the string or buffer at index
+inline const char* check_bytes(lua_State *L, int index, size_t &size)
+{
+    if(lua_type(L, index) == LUA_TSTRING)
+        return lua_tolstring(L, index, &size);
+    if(!isconvertible<const buffer>(L, index))
+        luaL_argerror(L, index, "string or buffer expected");
+    const buffer &bytes = to<const buffer>(L, index);
+    size = bytes.size();
+    return bytes.data();
+}
+
+// buffer:write_bytes(offset, bytes) copies a string or buffer into it
+inline luareturn buffer_write_bytes(buffer &self, lua_State *L)
+{
+    size_t size;
+    const char *bytes = check_bytes(L, 3, size);
+    size_t offset = check_buffer_offset(L, self, 2, size);
+    self.write_bytes(offset, bytes, size);
+    return luareturn(0);
+}
+
+// buffer:slice(offset[, size]) shares the bytes of the buffer
+inline luareturn buffer_slice(const buffer &self, lua_State *L)
+{
+    size_t offset = check_buffer_offset(L, self, 2, 0);
+    lua_Integer size = luaL_optinteger(L, 3, static_cast<lua_Integer>(self.size() - offset));
+    if(size < 0 || static_cast<size_t>(size) > self.size() - offset)
+        luaL_error(L, "buffer access out of range");
+    push(L, self.slice(offset, static_cast<size_t>(size)));
+    return luareturn(1);
+}
+
+// buffer:find(bytes[, from]) returns the offset of a string or buffer or nil
+inline luareturn buffer_find(const buffer &self, lua_State *L)
+{
+    size_t size;
+    const char *bytes = check_bytes(L, 2, size);
+    size_t from = lua_isnoneornil(L, 3) ? 0 : check_buffer_offset(L, self, 3, 0);
+    size_t found = self.find(bytes, size, from);
+    if(found == buffer::npos)
+        lua_pushnil(L);
+    else
+        lua_pushinteger(L, static_cast<lua_Integer>(found));
+    return luareturn(1);
+}
+
+// iterator of buffer:lines with the buffer and the offset of the next line
+// as upvalues
+inline int buffer_next_line(lua_State *L)
+{
+    const buffer &self = to<const buffer>(L, lua_upvalueindex(1));
+    lua_Integer start = lua_tointeger(L, lua_upvalueindex(2));
+    if(start < 0 || static_cast<size_t>(start) >= self.size())
+        return 0;
+    size_t end = self.find("\n", 1, static_cast<size_t>(start));
+    size_t next = end == buffer::npos ? self.size() : end + 1;
+    if(end == buffer::npos)
+        end = self.size();
+    lua_pushinteger(L, static_cast<lua_Integer>(next));
+    lua_replace(L, lua_upvalueindex(2));
+    if(lua_toboolean(L, lua_upvalueindex(3)))
+    {
+        lua_pushlstring(L, self.data() + start, end - static_cast<size_t>(start));
+        return 1;
+    }
+    lua_pushinteger(L, start);
+    lua_pushinteger(L, static_cast<lua_Integer>(end) - start);
+    return 2;
+}
+
+// buffer:lines([strings]) iterates the lines without their newline as offset
+// and size, or as strings if strings is true
+inline luareturn buffer_lines(const buffer&, lua_State *L)
+{
+    lua_settop(L, 2);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushboolean(L, lua_toboolean(L, 2));
+    lua_pushcclosure(L, buffer_next_line, 3);
+    return luareturn(1);
+}
+
+// buffer:close() releases the bytes, mapped files are unmapped once no
+// slice refers to them
+inline luareturn buffer_close(buffer &self, lua_State*)
+{
+    self.close();
+    return luareturn(0);
+}
+
+// buffer:tostring() copies the bytes into a lua string
+inline luareturn buffer_tostring(const buffer &self, lua_State *L)
+{
+    lua_pushlstring(L, self.data(), self.size());
+    return luareturn(1);
+}
+
+// __len gets a second argument
+inline size_t buffer_length(const buffer &self, lua_State*)
+{
+    return self.size();
+}
+
+// buffer.new(size) returns size zero bytes
+inline luareturn new_buffer(lua_State *L)
+{
+    lua_Integer size = luaL_checkinteger(L, 1);
+    if(size < 0)
+        luaL_argerror(L, 1, "negative buffer size");
+    push(L, buffer(static_cast<size_t>(size)));
+    return luareturn(1);
+}
+
+// buffer.from(bytes) returns a copy of a string or buffer
+inline luareturn buffer_from(lua_State *L)
+{
+    size_t size;
+    const char *bytes = check_bytes(L, 1, size);
+    push(L, buffer(bytes, size));
+    return luareturn(1);
+}
+
+#ifdef LUACPP11_HAS_MAP_FILE
+// buffer.map(path) returns the mapped file or nil and an error message
+inline luareturn buffer_map(lua_State *L)
+{
+    std::string path = luaL_checkstring(L, 1);
+    try
+    {
+        push(L, map_file(path));
+        return luareturn(1);
+    }
+    catch(const std::runtime_error &error)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, error.what());
+        return luareturn(2);
+    }
+}
+#endif
+
+}
+
+inline void class_hook<buffer>::on_register(lua_State *L)
+{
+    add_method(L, "__len", detail::buffer_length);
+    add_method(L, "size", &buffer::size);
+    add_method(L, "read", detail::buffer_read);
+    add_method(L, "write", detail::buffer_write);
+    add_method(L, "write_bytes", detail::buffer_write_bytes);
+    add_method(L, "slice", detail::buffer_slice);
+    add_method(L, "find", detail::buffer_find);
+    add_method(L, "lines", detail::buffer_lines);
+    add_method(L, "close", detail::buffer_close);
+    add_method(L, "tostring", detail::buffer_tostring);
+}
+
+// the module of buffer.new, buffer.from and buffer.map for push_module
+inline const module_entry* buffer_module()
+{
+    static const module_entry entries[] = {
+        LUACPP11_FUNCTION("new", detail::new_buffer),
+        LUACPP11_FUNCTION("from", detail::buffer_from),
+#ifdef LUACPP11_HAS_MAP_FILE
+        LUACPP11_FUNCTION("map", detail::buffer_map),
+#endif
+        {nullptr, 0, nullptr, 0, 0, nullptr, nullptr}
+    };
+    return entries;
+}
+
 }
 #endif